@@ -0,0 +1,86 @@
+#include <chrono>
+#include <cstdio>
+#include <duktape.h>
+#include <string>
+#include <vector>
+
+#include "../src/lib.h"
+
+// the same exports proxy main.cpp installs, with 64 handlers behind it
+static char const exports_source[] = R"((function(reg) {
+  var ret = new Proxy({}, {
+    set: function(tgt, prop, value) {
+      tgt[prop] = value;
+      reg(prop, value);
+      return value;
+    }
+  });
+  for (var i = 0; i < 64; i++) ret['method' + i] = function(arg) { return arg; };
+  ret.status = cached({ ttlMs: 60000 }, function(arg) { return arg; });
+  return ret;
+}))";
+
+template <typename F> static double measure(int rounds, F fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) fn();
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / rounds;
+}
+
+int main() {
+  constexpr int rounds = 200000;
+  auto ctx             = duk_create_heap_default();
+  init_duk_json(ctx);
+  init_duk_exports(ctx);
+  duk_eval_string(ctx, exports_source);
+  duk_push_c_function(
+      ctx,
+      +[](duk_context *ctx) -> duk_ret_t {
+        export_define(ctx, duk_get_string(ctx, 0), 1);
+        return 0;
+      },
+      2);
+  duk_call(ctx, 1);
+  auto registry = duk_get_heapptr(ctx, -1);
+  std::vector<std::string> names;
+  std::vector<export_entry *> entries;
+  // the heap pointers a table slot holds, read once so resolving can be timed apart from the call
+  std::vector<void *> slots;
+  for (int i = 0; i < 64; i++) {
+    names.push_back("method" + std::to_string(i));
+    entries.push_back(&export_slot(names.back()));
+    duk_get_prop_string(ctx, -1, names.back().c_str());
+    slots.push_back(duk_get_heapptr(ctx, -1));
+    duk_pop(ctx);
+  }
+  auto &status = export_slot("status");
+  nlohmann::json const data = { { "id", 42 } };
+  // what main.cpp did before: intern the name and look it up through the proxy on every request
+  auto proxy = [&](int i) {
+    duk_push_heapptr(ctx, registry);
+    duk_get_prop_string(ctx, -1, names[i % 64].c_str());
+    duk_swap_top(ctx, -2);
+  };
+  auto table = [&](int i) {
+    duk_push_heapptr(ctx, slots[i % 64]);
+    duk_push_heapptr(ctx, registry);
+  };
+  int i = 0;
+  auto proxy_resolve = measure(rounds, [&] {
+    proxy(i++);
+    duk_pop_2(ctx);
+  });
+  auto table_resolve = measure(rounds, [&] {
+    table(i++);
+    duk_pop_2(ctx);
+  });
+  auto proxy_call = measure(rounds, [&] {
+    proxy(i++);
+    duk_call_export(ctx, data);
+  });
+  auto table_call  = measure(rounds, [&] { export_dispatch(ctx, *entries[i++ % 64], registry, nullptr, data); });
+  auto cached_call = measure(rounds, [&] { export_dispatch(ctx, status, registry, nullptr, data); });
+  printf("resolve  proxy %7.1fns  table %7.1fns (x%.2f)\n", proxy_resolve, table_resolve, proxy_resolve / table_resolve);
+  printf("call     proxy %7.1fns  table %7.1fns (x%.2f)  cached %7.1fns (x%.2f)\n", proxy_call, table_call, proxy_call / table_call,
+         cached_call, proxy_call / cached_call);
+  duk_destroy_heap(ctx);
+}
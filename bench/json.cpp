@@ -0,0 +1,76 @@
+#include <chrono>
+#include <cstdio>
+#include <duktape.h>
+
+#include "../src/lib.h"
+
+static struct {
+  char const *name;
+  char const *source;
+  int indent;
+} const payloads[] = {
+  { "events", R"((function() {
+      var ret = [];
+      for (var i = 0; i < 500; i++) ret.push({ service: 'game-' + (i % 8), line: '[' + i + '] player joined the "lobby"\t', ts: 1571400000000 + i });
+      return ret;
+    })())", 0 },
+  { "services", R"((function() {
+      var ret = {};
+      for (var i = 0; i < 200; i++) ret['svc' + i] = { pid: 1000 + i, status: i % 3 ? 'running' : 'stopped', restart: i % 5 == 0, load: i / 7, args: ['-c', '/etc/svc' + i] };
+      return ret;
+    })())", 0 },
+  { "numbers", R"((function() {
+      var ret = [];
+      for (var i = 0; i < 2000; i++) ret.push(i * 3.25, -i, 1e21 + i);
+      return ret;
+    })())", 0 },
+  { "pretty", R"((function() {
+      var ret = [];
+      for (var i = 0; i < 300; i++) ret.push({ name: 'entry' + i, tags: ['a', 'b'], nested: { depth: i % 4 } });
+      return ret;
+    })())", 4 },
+};
+
+template <typename F> static double measure(int rounds, F fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) fn();
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / rounds;
+}
+
+static void call(duk_context *ctx, duk_idx_t json, char const *method, duk_idx_t arg, int indent = 0) {
+  duk_get_prop_string(ctx, json, method);
+  duk_dup(ctx, arg);
+  duk_push_null(ctx);
+  duk_push_int(ctx, indent);
+  duk_call(ctx, 3);
+}
+
+int main() {
+  constexpr int rounds = 200;
+  auto ctx             = duk_create_heap_default();
+  init_duk_json(ctx);
+  duk_get_global_string(ctx, "JSON");
+  auto json = duk_get_top_index(ctx);
+  for (auto [name, source, indent] : payloads) {
+    duk_eval_string(ctx, source);
+    auto value = duk_get_top_index(ctx);
+    call(ctx, json, "stringify", value, indent);
+    auto text      = duk_get_top_index(ctx);
+    auto stringify = measure(rounds, [&] {
+      call(ctx, json, "stringify", value, indent);
+      duk_pop(ctx);
+    });
+    auto builtin = measure(rounds, [&] {
+      call(ctx, json, DUK_HIDDEN_SYMBOL("parse"), text);
+      duk_pop(ctx);
+    });
+    auto native = measure(rounds, [&] {
+      call(ctx, json, "parse", text);
+      duk_pop(ctx);
+    });
+    printf("%-10s %8lu bytes  stringify %9.1fus  parse %9.1fus -> %9.1fus (x%.2f)\n", name, (unsigned long)duk_get_length(ctx, text), stringify,
+           builtin, native, builtin / native);
+    duk_pop_2(ctx);
+  }
+  duk_destroy_heap(ctx);
+}
@@ -0,0 +1,49 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "../src/lib.h"
+
+static std::string repeat(char const *piece, size_t size) {
+  std::string ret;
+  while (ret.size() < size) ret += piece;
+  return ret;
+}
+
+static struct {
+  char const *name;
+  std::string text;
+} const payloads[] = {
+  { "ascii", repeat("[42] player joined the \"lobby\"\t", 1 << 20) },
+  { "mixed", repeat("[42] player joined the lobby \xe2\x9c\x93 caf\xc3\xa9 ", 1 << 20) },
+  { "cjk", repeat("\xe7\x8e\xa9\xe5\xae\xb6\xe5\x8a\xa0\xe5\x85\xa5\xe5\xa4\xa7\xe5\x8e\x85", 1 << 20) },
+  { "emoji", repeat("\xf0\x9f\x8e\xae\xf0\x9f\x8f\x86 ok ", 1 << 20) },
+};
+
+static struct {
+  char const *name;
+  utf8_kernel kernel;
+} const kernels[] = {
+  { "scalar", utf8_kernel::scalar },
+  { "sse2", utf8_kernel::sse2 },
+  { "avx2", utf8_kernel::avx2 },
+};
+
+template <typename F> static double measure(int rounds, F fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) fn();
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / rounds;
+}
+
+int main() {
+  constexpr int rounds = 200;
+  for (auto &[name, text] : payloads) {
+    printf("%-6s %8lu bytes", name, (unsigned long)text.size());
+    for (auto [kernel_name, kernel] : kernels) {
+      bool ok    = true;
+      auto usecs = measure(rounds, [&] { ok &= utf8_validate(text.data(), text.size(), kernel); });
+      printf("  %s %7.1fus %6.2fGB/s%s", kernel_name, usecs, text.size() / usecs / 1e3, ok ? "" : " (unsupported)");
+    }
+    printf("\n");
+  }
+}
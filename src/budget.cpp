@@ -0,0 +1,87 @@
+#include "lib.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <duktape.h>
+
+LOAD_ENV(YSRV_CALL_BUDGET, "5000");
+LOAD_ENV(YSRV_CALLBACK_BUDGET, "1000");
+
+unsigned const exec_budget::call     = std::stoul(YSRV_CALL_BUDGET);
+unsigned const exec_budget::callback = std::stoul(YSRV_CALLBACK_BUDGET);
+
+static std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+// polled by the bytecode executor every interrupt counter period, a true result throws a RangeError into the running
+// code and keeps doing so until the guard that set the deadline has unwound
+duk_bool_t ysrv_exec_timeout_check(void *) {
+  return deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= deadline;
+}
+
+exec_budget::exec_budget(unsigned ms)
+    : saved(deadline) {
+  if (ms) deadline = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(ms));
+}
+
+exec_budget::~exec_budget() { deadline = saved; }
+
+unsigned exec_budget::of(duk_context *ctx, duk_idx_t idx, unsigned fallback) {
+  if (!duk_get_prop_string(ctx, idx, DUK_HIDDEN_SYMBOL("budget"))) {
+    duk_pop(ctx);
+    return fallback;
+  }
+  auto ret = duk_get_uint(ctx, -1);
+  duk_pop(ctx);
+  return ret;
+}
+
+static duk_ret_t forward(duk_context *ctx) {
+  auto nargs = duk_get_top(ctx);
+  duk_push_current_function(ctx);
+  duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("target"));
+  duk_insert(ctx, 0);
+  duk_pop(ctx);
+  duk_push_this(ctx);
+  duk_insert(ctx, 1);
+  duk_call_method(ctx, nargs);
+  return 1;
+}
+
+void duk_push_wrapper(duk_context *ctx, duk_idx_t idx) {
+  idx = duk_require_normalize_index(ctx, idx);
+  duk_push_c_function(ctx, forward, DUK_VARARGS);
+  if (duk_get_prop_string(ctx, idx, DUK_HIDDEN_SYMBOL("target"))) {
+    // hidden symbols start with a 0xff byte, which also covers the target itself
+    duk_enum(ctx, idx, DUK_ENUM_OWN_PROPERTIES_ONLY | DUK_ENUM_INCLUDE_HIDDEN | DUK_ENUM_INCLUDE_SYMBOLS | DUK_ENUM_INCLUDE_NONENUMERABLE);
+    while (duk_next(ctx, -1, 1)) {
+      if ((unsigned char)*duk_get_string(ctx, -2) == 0xff)
+        duk_put_prop(ctx, -5);
+      else
+        duk_pop_2(ctx);
+    }
+    duk_pop(ctx);
+  } else {
+    duk_dup(ctx, idx);
+    duk_put_prop_string(ctx, -3, DUK_HIDDEN_SYMBOL("target"));
+  }
+  duk_pop(ctx);
+  // handlers are told apart by how many parameters they declare
+  duk_push_string(ctx, "length");
+  duk_get_prop_string(ctx, idx, "length");
+  duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_FORCE);
+}
+
+void init_duk_budget(duk_context *ctx) {
+  duk_push_c_function(
+      ctx,
+      +[](duk_context *ctx) -> duk_ret_t {
+        auto ms = duk_require_uint(ctx, 0);
+        duk_require_function(ctx, 1);
+        duk_push_wrapper(ctx, 1);
+        duk_push_uint(ctx, ms);
+        duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("budget"));
+        return 1;
+      },
+      2);
+  duk_put_global_string(ctx, "budget");
+}
@@ -1,6 +1,7 @@
 #include <cxxabi.h>
 #include <rpcws.hpp>
 
+#include "pending.h"
 #include "utils.h"
 
 LOAD_ENV(YSRV_ENDPOINT, "ws://127.0.0.1:23456/api/token");
@@ -11,8 +12,18 @@ int main(int argc, char **argv) {
   try {
     auto ep = std::make_shared<epoll>();
     static RPC::Client endpoint{ std::make_unique<client_wsio>(YSRV_ENDPOINT, ep) };
+    static pending_replies pending{ endpoint };
     endpoint.call(argv[1], json::object({ { "command", argv[2] } }))
         .then([&](json res) {
+          auto chunk  = [](json const &data, uint64_t index) { std::cout << "chunk " << index << ": " << data << std::endl; };
+          auto settle = [&](json const &reply) {
+            if (reply.contains("error"))
+              std::cerr << "error: " << reply["error"] << std::endl;
+            else
+              std::cout << "recv: " << reply.value("result", json{}) << std::endl;
+            ep->shutdown();
+          };
+          if (pending.follow(res, chunk, settle)) return;
           std::cout << "recv: " << res << std::endl;
           ep->shutdown();
         })
@@ -0,0 +1,78 @@
+#include "lib.h"
+#include "utils.h"
+
+#include <duktape.h>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+LOAD_ENV(YSRV_COMPILE_CACHE, "64");
+
+// Compiled functions live in a hidden global table indexed by slot; the list keeps them in recency order and the map
+// finds an entry by its source text, so a hit costs one hash of the source and no trip through the compiler.
+struct compiled_entry {
+  std::string source;
+  duk_uarridx_t slot;
+};
+
+static size_t const capacity = std::stoul(YSRV_COMPILE_CACHE);
+static std::list<compiled_entry> recency;
+static std::unordered_map<std::string_view, std::list<compiled_entry>::iterator> entries;
+static uint64_t hits, misses, evictions;
+
+static duk_ret_t compile_cached(duk_context *ctx) {
+  duk_size_t len;
+  auto data = duk_require_lstring(ctx, 0, &len);
+  std::string_view source{ data, len };
+  duk_get_global_string(ctx, DUK_HIDDEN_SYMBOL("compiled"));
+  if (auto it = entries.find(source); it != entries.end()) {
+    hits++;
+    recency.splice(recency.begin(), recency, it->second);
+    duk_get_prop_index(ctx, -1, it->second->slot);
+    return 1;
+  }
+  misses++;
+  duk_dup(ctx, 0);
+  duk_push_string(ctx, "compileCached");
+  if (duk_pcompile(ctx, DUK_COMPILE_EVAL) != DUK_EXEC_SUCCESS) return duk_throw(ctx);
+  if (!capacity) return 1;
+  duk_uarridx_t slot = recency.size();
+  if (recency.size() == capacity) {
+    slot = recency.back().slot;
+    entries.erase(recency.back().source);
+    recency.pop_back();
+    evictions++;
+  }
+  recency.push_front({ std::string{ source }, slot });
+  entries.emplace(recency.front().source, recency.begin());
+  duk_dup_top(ctx);
+  duk_put_prop_index(ctx, -3, slot);
+  return 1;
+}
+
+static duk_ret_t compile_stats(duk_context *ctx) {
+  duk_push_object(ctx);
+  duk_push_number(ctx, (duk_double_t)hits);
+  duk_put_prop_string(ctx, -2, "hits");
+  duk_push_number(ctx, (duk_double_t)misses);
+  duk_put_prop_string(ctx, -2, "misses");
+  duk_push_number(ctx, (duk_double_t)evictions);
+  duk_put_prop_string(ctx, -2, "evictions");
+  duk_push_number(ctx, hits + misses ? (duk_double_t)hits / (hits + misses) : 0);
+  duk_put_prop_string(ctx, -2, "hitRate");
+  duk_push_uint(ctx, recency.size());
+  duk_put_prop_string(ctx, -2, "size");
+  duk_push_uint(ctx, capacity);
+  duk_put_prop_string(ctx, -2, "capacity");
+  return 1;
+}
+
+void init_duk_compile(duk_context *ctx) {
+  duk_push_bare_object(ctx);
+  duk_put_global_string(ctx, DUK_HIDDEN_SYMBOL("compiled"));
+  duk_push_c_function(ctx, compile_cached, 1);
+  duk_push_c_function(ctx, compile_stats, 0);
+  duk_put_prop_string(ctx, -2, "stats");
+  duk_put_global_string(ctx, "compileCached");
+}
@@ -0,0 +1,429 @@
+#include "lib.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <rpcws.hpp>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/timerfd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+using json = nlohmann::json;
+
+// {"service": "game-1", "/meta/host": {"prefix": "eu-"}}: each key is a top level field or a json pointer, each value
+// is either the literal the field has to equal or {"prefix": string}
+struct event_filter {
+  struct condition {
+    std::vector<std::string> path;
+    json value;
+    bool prefix;
+  };
+  std::vector<condition> conditions;
+
+  explicit event_filter(json const &spec) {
+    if (!spec.is_object()) throw std::runtime_error("filter must be an object");
+    for (auto &[key, value] : spec.items()) {
+      condition cond{ {}, value, false };
+      if (key.empty() || key[0] != '/') {
+        cond.path.push_back(key);
+      } else {
+        for (size_t pos = 1, next; pos <= key.size(); pos = next + 1) {
+          next = key.find('/', pos);
+          if (next == std::string::npos) next = key.size();
+          cond.path.push_back(key.substr(pos, next - pos));
+        }
+      }
+      if (value.is_object()) {
+        if (value.size() != 1 || !value.contains("prefix") || !value["prefix"].is_string()) throw std::runtime_error("unsupported filter on " + key);
+        cond.value  = value["prefix"];
+        cond.prefix = true;
+      }
+      conditions.push_back(std::move(cond));
+    }
+  }
+
+  bool match(json const &data) const {
+    for (auto &cond : conditions) {
+      auto field = &data;
+      for (auto &key : cond.path) {
+        if (!field->is_object()) return false;
+        auto it = field->find(key);
+        if (it == field->end()) return false;
+        field = &*it;
+      }
+      if (cond.prefix) {
+        if (!field->is_string()) return false;
+        auto &str = field->get_ref<std::string const &>();
+        auto &pre = cond.value.get_ref<std::string const &>();
+        if (str.compare(0, pre.size(), pre) != 0) return false;
+      } else if (*field != cond.value) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+struct subscription {
+  std::string topic;
+  event_filter filter;
+  bool wildcard;
+  // the last value of each delta event this filtered subscription was sent, which its patches are taken against
+  mutable std::unordered_map<std::string, json> views;
+};
+
+// subscriptions keyed by dot separated segments of the event name, "*" matches exactly one segment
+struct topic_trie {
+  std::unordered_map<std::string, std::unique_ptr<topic_trie>> children;
+  std::unique_ptr<topic_trie> star;
+  std::vector<subscription> subscriptions;
+
+  topic_trie &insert(std::string_view pattern) {
+    auto node = this;
+    for (size_t pos = 0, next; pos <= pattern.size(); pos = next + 1) {
+      next = pattern.find('.', pos);
+      if (next == std::string_view::npos) next = pattern.size();
+      auto segment = pattern.substr(pos, next - pos);
+      auto &child  = segment == "*" ? node->star : node->children[std::string{ segment }];
+      if (!child) child = std::make_unique<topic_trie>();
+      node = child.get();
+    }
+    return *node;
+  }
+
+  template <typename F> void match(std::string_view name, size_t pos, F &&fn) const {
+    if (pos > name.size()) {
+      for (auto &sub : subscriptions) fn(sub);
+      return;
+    }
+    auto next = name.find('.', pos);
+    if (next == std::string_view::npos) next = name.size();
+    if (!children.empty())
+      if (auto it = children.find(std::string{ name.substr(pos, next - pos) }); it != children.end()) it->second->match(name, next + 1, fn);
+    if (star) star->match(name, next + 1, fn);
+  }
+};
+
+// journaled events keep their last values in memory and are sent as {seq, data}, seq counting up per event;
+// coalesced events are sent as an array of everything emitted within coalesceMs, at most maxBatch items at once;
+// delta events remember the last value and are sent as a merge patch (RFC 7386) against it, ysrv.snapshot gives the
+// value to apply the patches to, and given a subscription's topic the one that subscription was last sent;
+// private events reach only clients that were told their name, ysrv.subscribe and wildcards never match them
+struct event_topic {
+  json options;
+  size_t journal = 0, coalesce_ms = 0, max_batch = 0;
+  bool delta   = false;
+  bool hidden  = false;
+  uint64_t seq = 0;
+  std::deque<std::pair<uint64_t, json>> history;
+  json pending = json::array();
+  int timer    = -1;
+  json last;
+};
+
+// filtered subscriptions are published as their own topics, so the number of them is capped, per connection too so
+// that one client can not take them all; a topic is dropped once every connection that asked for it released it
+constexpr size_t max_subscriptions        = 1024;
+constexpr size_t max_client_subscriptions = 64;
+constexpr size_t max_journal       = 4096;
+constexpr size_t max_coalesce_ms   = 60000;
+constexpr size_t max_batch_items   = 65536;
+// a retired event keeps its journal this long for clients that subscribe or reconnect late
+constexpr auto retire_linger = std::chrono::seconds(60);
+
+// sequence numbers restart with the process, so clients compare this before resuming
+static auto const epoch = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+static std::unordered_map<std::string, event_topic> declared;
+static std::unordered_map<int, std::string> coalesce_timers;
+// subscription topics with the number of connections holding each
+static std::unordered_map<std::string, size_t> topics;
+// connections are not announced when they go away, so what they hold stays until they release it
+static std::unordered_map<void const *, std::unordered_set<std::string>> held;
+static topic_trie subscriptions;
+static std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>> retired;
+
+static std::string const &event_param(json const &params) {
+  if (!params.is_object() || !params.contains("event") || !params["event"].is_string()) throw std::runtime_error("event required");
+  return params["event"].get_ref<std::string const &>();
+}
+
+static std::string subscribe(void const *client, json const &params) {
+  auto &pattern = event_param(params);
+  bool wildcard = false;
+  for (size_t pos = 0, next; pos <= pattern.size(); pos = next + 1) {
+    next = pattern.find('.', pos);
+    if (next == std::string::npos) next = pattern.size();
+    auto segment = std::string_view{ pattern }.substr(pos, next - pos);
+    if (segment.empty() || (segment.find('*') != std::string_view::npos && segment != "*"))
+      throw std::runtime_error("invalid event pattern " + pattern);
+    wildcard |= segment == "*";
+  }
+  if (!wildcard) {
+    auto it = declared.find(pattern);
+    if (it == declared.end() || it->second.hidden) throw std::runtime_error("unknown event " + pattern);
+  }
+  auto spec = params.value("filter", json::object());
+  event_filter filter{ spec };
+  // object keys are kept sorted, so equal filters share one topic
+  auto topic = pattern + "?" + spec.dump();
+  auto &mine = held[client];
+  if (mine.count(topic)) return topic;
+  if (mine.size() >= max_client_subscriptions) throw std::runtime_error("too many filtered subscriptions on this connection");
+  if (!topics.count(topic)) {
+    if (topics.size() >= max_subscriptions) throw std::runtime_error("too many filtered subscriptions");
+    // wsrpc keeps the name of a released topic registered, subscribing to it again reuses that
+    static std::unordered_set<std::string> registered;
+    if (registered.insert(topic).second) holder<rpcws::RPC>()->event(topic);
+    subscriptions.insert(pattern).subscriptions.push_back({ topic, std::move(filter), wildcard });
+  }
+  topics[topic]++;
+  mine.insert(topic);
+  return topic;
+}
+
+static bool unsubscribe(void const *client, json const &params) {
+  auto &topic = event_param(params);
+  auto it     = held.find(client);
+  if (it == held.end() || !it->second.erase(topic)) return false;
+  if (it->second.empty()) held.erase(it);
+  if (--topics[topic]) return true;
+  topics.erase(topic);
+  auto &subs = subscriptions.insert(std::string_view{ topic }.substr(0, topic.find('?'))).subscriptions;
+  std::erase_if(subs, [&](subscription const &sub) { return sub.topic == topic; });
+  return true;
+}
+
+static json resume(json const &params) {
+  auto &name = event_param(params);
+  auto it    = declared.find(name);
+  if (it == declared.end() || !it->second.journal) throw std::runtime_error("event " + name + " is not journaled");
+  auto &topic = it->second;
+  auto since  = params.value("since", (uint64_t)0);
+  json events = json::array();
+  for (auto &[seq, data] : topic.history)
+    if (seq > since) events.push_back({ { "seq", seq }, { "data", data } });
+  auto complete = topic.history.empty() ? since >= topic.seq : since + 1 >= topic.history.front().first;
+  return { { "epoch", epoch }, { "seq", topic.seq }, { "events", std::move(events) }, { "complete", complete } };
+}
+
+static bool pattern_match(std::string_view pattern, std::string_view name) {
+  size_t pos = 0, at = 0;
+  for (size_t next; pos <= pattern.size(); pos = next + 1) {
+    next = pattern.find('.', pos);
+    if (next == std::string_view::npos) next = pattern.size();
+    if (at > name.size()) return false;
+    auto end = std::min(name.find('.', at), name.size());
+    if (pattern.substr(pos, next - pos) != "*" && pattern.substr(pos, next - pos) != name.substr(at, end - at)) return false;
+    at = end + 1;
+  }
+  return at > name.size();
+}
+
+// A subscription's topic gets the values it was sent, keyed by event name when its pattern has wildcards; null is a
+// value that does not match the filter.
+static json subscription_snapshot(std::string const &name) {
+  auto pattern = std::string_view{ name }.substr(0, name.find('?'));
+  auto &subs   = subscriptions.insert(pattern).subscriptions;
+  auto &sub    = *std::find_if(subs.begin(), subs.end(), [&](subscription const &sub) { return sub.topic == name; });
+  auto view_of = [&](std::string const &event, event_topic const &topic) -> json {
+    if (sub.filter.conditions.empty()) return { { "seq", topic.seq }, { "value", topic.last } };
+    auto it = sub.views.find(event);
+    return { { "seq", topic.seq }, { "value", it == sub.views.end() ? json{} : it->second } };
+  };
+  if (!sub.wildcard) {
+    auto it = declared.find(std::string{ pattern });
+    if (it == declared.end() || !it->second.delta) throw std::runtime_error("event " + std::string{ pattern } + " is not a delta event");
+    return view_of(it->first, it->second);
+  }
+  json ret = json::object();
+  for (auto &[event, topic] : declared)
+    if (topic.delta && !topic.hidden && pattern_match(pattern, event)) ret[event] = view_of(event, topic);
+  return ret;
+}
+
+static json snapshot(json const &params) {
+  auto &name = event_param(params);
+  if (topics.count(name)) return subscription_snapshot(name);
+  auto it = declared.find(name);
+  if (it == declared.end() || !it->second.delta) throw std::runtime_error("event " + name + " is not a delta event");
+  return { { "seq", it->second.seq }, { "value", it->second.last } };
+}
+
+// fields set to null can not be told apart from removed ones, and arrays are always replaced whole
+static json merge_diff(json const &from, json const &to) {
+  if (!from.is_object() || !to.is_object()) return to;
+  json patch = json::object();
+  for (auto &[key, value] : from.items())
+    if (!to.contains(key)) patch[key] = nullptr;
+  for (auto &[key, value] : to.items()) {
+    auto it = from.find(key);
+    if (it == from.end())
+      patch[key] = value;
+    else if (*it != value)
+      patch[key] = merge_diff(*it, value);
+  }
+  return patch;
+}
+
+static size_t option(json const &options, char const *key, size_t max) {
+  auto it = options.find(key);
+  if (it == options.end()) return 0;
+  auto value = it->is_number() ? it->get<double>() : -1;
+  if (value < 0 || value > max || value != (size_t)value)
+    throw std::runtime_error(std::string{ key } + " must be an integer up to " + std::to_string(max));
+  return (size_t)value;
+}
+
+static void publish(std::string const &name, event_topic *topic, json data) {
+  auto &endpoint = *holder<rpcws::RPC>();
+  uint64_t seq   = 0;
+  if (topic && topic->journal) {
+    if (topic->history.size() == topic->journal) topic->history.pop_front();
+    topic->history.emplace_back(seq = ++topic->seq, data);
+  }
+  json full       = seq ? json{ { "seq", seq }, { "data", std::move(data) } } : std::move(data);
+  json const &raw = seq ? full.at("data") : full;
+  if (!topics.empty() && !(topic && topic->hidden)) {
+    auto batched = topic && topic->coalesce_ms;
+    // a wildcard topic carries several events, so its values are wrapped with the name they were emitted as
+    json wrapped;
+    subscriptions.match(name, 0, [&](subscription const &sub) {
+      if (batched && !sub.filter.conditions.empty()) {
+        // filters apply to each item of a coalesced batch
+        json items = json::array();
+        for (auto &item : raw)
+          if (sub.filter.match(item)) items.push_back(item);
+        if (items.empty()) return;
+        json part = seq ? json{ { "seq", seq }, { "data", std::move(items) } } : std::move(items);
+        if (sub.wildcard) part = { { "event", name }, { "data", std::move(part) } };
+        return endpoint.emit(sub.topic, std::move(part));
+      }
+      if (topic && topic->delta && !sub.filter.conditions.empty()) {
+        // filters look at the whole new value, a patch may not carry the filtered fields at all; a value that stops
+        // matching is sent as a null patch, which replaces the subscriber's copy, so it comes whole once it matches again
+        json patch;
+        if (sub.filter.match(topic->last)) {
+          auto &view = sub.views[name];
+          if (view == topic->last) return;
+          patch = merge_diff(view, topic->last);
+          view  = topic->last;
+        } else {
+          auto it = sub.views.find(name);
+          if (it == sub.views.end()) return;
+          sub.views.erase(it);
+        }
+        json part = seq ? json{ { "seq", seq }, { "data", std::move(patch) } } : std::move(patch);
+        if (sub.wildcard) part = { { "event", name }, { "data", std::move(part) } };
+        return endpoint.emit(sub.topic, std::move(part));
+      }
+      if (!sub.filter.match(raw)) return;
+      if (!sub.wildcard) return endpoint.emit(sub.topic, full);
+      if (wrapped.is_null()) wrapped = { { "event", name }, { "data", full } };
+      endpoint.emit(sub.topic, wrapped);
+    });
+  }
+  endpoint.emit(name, std::move(full));
+}
+
+static void flush(std::string const &name, event_topic &topic) {
+  if (topic.pending.empty()) return;
+  itimerspec spec{};
+  timerfd_settime(topic.timer, 0, &spec, nullptr);
+  publish(name, &topic, std::exchange(topic.pending, json::array()));
+}
+
+// wsrpc has no way to unregister an event, so only the name stays behind
+static void sweep_retired() {
+  auto now = std::chrono::steady_clock::now();
+  while (!retired.empty() && retired.front().first <= now) {
+    if (auto it = declared.find(retired.front().second); it != declared.end()) {
+      if (it->second.timer >= 0) {
+        coalesce_timers.erase(it->second.timer);
+        close(it->second.timer);
+      }
+      declared.erase(it);
+    }
+    retired.pop_front();
+  }
+}
+
+void event_declare(std::string const &name, json const &options) {
+  sweep_retired();
+  event_topic topic;
+  topic.options = options.is_null() ? json::object() : options;
+  if (!topic.options.is_object()) throw std::runtime_error("event options must be an object");
+  if (auto it = declared.find(name); it != declared.end()) {
+    if (!options.is_null() && it->second.options != topic.options) throw std::runtime_error("event " + name + " already declared with other options");
+    return;
+  }
+  topic.journal     = option(topic.options, "journal", max_journal);
+  topic.coalesce_ms = option(topic.options, "coalesceMs", max_coalesce_ms);
+  topic.max_batch   = option(topic.options, "maxBatch", max_batch_items);
+  if (topic.max_batch && !topic.coalesce_ms) throw std::runtime_error("maxBatch needs coalesceMs");
+  if (auto delta = topic.options.find("delta"); delta != topic.options.end()) {
+    if (!delta->is_boolean()) throw std::runtime_error("delta must be a boolean");
+    topic.delta = *delta;
+  }
+  if (topic.delta && topic.coalesce_ms) throw std::runtime_error("delta can not be combined with coalesceMs");
+  if (auto hidden = topic.options.find("private"); hidden != topic.options.end()) {
+    if (!hidden->is_boolean()) throw std::runtime_error("private must be a boolean");
+    topic.hidden = *hidden;
+  }
+  if (topic.coalesce_ms) {
+    static auto coalesce_handler = holder<std::shared_ptr<epoll>>()->reg([](epoll_event const &ev) {
+      uint64_t tmp;
+      read(ev.data.fd, &tmp, sizeof tmp);
+      auto &name = coalesce_timers.at(ev.data.fd);
+      flush(name, declared.at(name));
+    });
+    if (!topic.max_batch) topic.max_batch = 256;
+    topic.timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    holder<std::shared_ptr<epoll>>()->add(EPOLLIN, topic.timer, coalesce_handler);
+    coalesce_timers.emplace(topic.timer, name);
+  }
+  declared.emplace(name, std::move(topic));
+  holder<rpcws::RPC>()->event(name);
+}
+
+void event_emit(std::string const &name, json data) {
+  auto it = declared.find(name);
+  if (it == declared.end()) return publish(name, nullptr, std::move(data));
+  auto &topic = it->second;
+  if (topic.delta) {
+    if (data == topic.last) return;
+    auto patch = merge_diff(topic.last, data);
+    topic.last = std::move(data);
+    return publish(name, &topic, std::move(patch));
+  }
+  if (!topic.coalesce_ms) return publish(name, &topic, std::move(data));
+  topic.pending.push_back(std::move(data));
+  if (topic.pending.size() >= topic.max_batch) {
+    flush(name, topic);
+  } else if (topic.pending.size() == 1) {
+    itimerspec spec = {
+      .it_interval = {},
+      .it_value    = { .tv_sec = (time_t)(topic.coalesce_ms / 1000), .tv_nsec = (long)(topic.coalesce_ms % 1000 * 1000000) },
+    };
+    timerfd_settime(topic.timer, 0, &spec, nullptr);
+  }
+}
+
+void event_retire(std::string const &name) {
+  sweep_retired();
+  retired.emplace_back(std::chrono::steady_clock::now() + retire_linger, name);
+}
+
+void init_events() {
+  holder<rpcws::RPC>()->reg("ysrv.subscribe", [](auto const &client, json params) -> json { return subscribe(client_identity(client), params); });
+  holder<rpcws::RPC>()->reg("ysrv.unsubscribe", [](auto const &client, json params) -> json { return unsubscribe(client_identity(client), params); });
+  holder<rpcws::RPC>()->reg("ysrv.resume", [](auto, json params) -> json { return resume(params); });
+  holder<rpcws::RPC>()->reg("ysrv.snapshot", [](auto, json params) -> json { return snapshot(params); });
+}
@@ -0,0 +1,959 @@
+#include "lib.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <duktape.h>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <map>
+#include <optional>
+#include <random>
+#include <rpcws.hpp>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unordered_map>
+#include <vector>
+
+using json = nlohmann::json;
+
+// A call stays "running" while its handler is on the stack, a reply made during that time is returned directly;
+// afterwards it is "pending" until reply()/the thenable settles, and the result goes out on each caller's reply topic.
+// A pending call that passes its deadline or is cancelled by its caller is answered with an error right away and
+// stays "cancelled" until the handler's own late reply, which is dropped.
+enum class call_state { running, replied, pending, cancelled };
+
+using deadline_t = std::chrono::steady_clock::time_point;
+
+struct call_meta {
+  void const *caller = nullptr;
+  deadline_t deadline = deadline_t::max();
+  // this caller's private topics, named when it is first answered with $pending
+  std::string reply, stream;
+};
+
+// Chunks of a streaming() export go out on each caller's stream topic as { id, index, data }; the caller acknowledges
+// them with ysrv.ack, and write() reports false once size chunks are unacknowledged so the handler waits for ondrain.
+// Writing to a full window throws, the stream topic only journals that many chunks. The final reply carries the
+// number of chunks written so a caller can tell whether it still misses some.
+struct stream_window {
+  uint64_t written = 0, acked = 0, size;
+
+  bool open() const { return written - acked < size; }
+};
+
+struct call_ticket {
+  call_state state = call_state::running;
+  json reply;
+  std::function<void()> done;
+  call_meta meta;
+  // everyone the reply goes to: the caller that started the call and those who joined its single flight
+  std::vector<call_meta> callers;
+  // handlers declaring a third parameter get a context object, kept in the hidden contexts table for oncancel
+  bool context = false;
+  // a streaming call gets a stream object in place of reply, kept in the hidden streams table for ondrain
+  std::optional<stream_window> stream;
+};
+
+// Replies and stream chunks go out on "ysrv.reply.<token>" and "ysrv.stream.<token>", private events minted for each
+// caller of each pending call, whose random names are only ever sent to that caller in the $reply and $stream fields of
+// its $pending answer. They are journaled so a client that subscribes late or reconnects can pick them up through
+// ysrv.resume, and retired once the caller has been answered. A stream topic journals as many chunks as the window
+// lets the handler run ahead of the caller, so the window is capped at the longest journal events.cpp keeps.
+constexpr size_t reply_journal  = 1;
+constexpr size_t default_window = 16;
+constexpr size_t max_window     = 4096;
+
+static std::unordered_map<uint64_t, call_ticket> tickets;
+static uint64_t last_ticket;
+static size_t cancelled_tickets;
+static duk_context *heap;
+// the call whose code is running, so rpc.call can pass its deadline upstream
+static uint64_t current_call;
+static unix_file deadline_timer;
+static std::multimap<deadline_t, uint64_t> deadlines;
+// Replies of a cached() export keyed by the dumped params, which nlohmann keeps in sorted key order, so equal params
+// always produce the same key. A hit is answered from here without entering Duktape; entries leave by TTL or LRU.
+struct response_cache {
+  struct entry {
+    std::string key;
+    std::chrono::steady_clock::time_point expires;
+    json reply;
+  };
+  std::chrono::milliseconds ttl;
+  size_t capacity;
+  std::list<entry> recency;
+  std::unordered_map<std::string_view, std::list<entry>::iterator> entries;
+};
+
+struct priority_class;
+
+// Admission runs before params reach Duktape: a call has to get a token from its connection's bucket and from the
+// method's rateLimit() bucket, and is shed while YSRV_MAX_INFLIGHT tickets are pending or queued.
+struct token_bucket {
+  double tokens;
+  std::chrono::steady_clock::time_point last;
+
+  bool take(double rate, double burst, std::chrono::steady_clock::time_point now) {
+    tokens = std::min(burst, tokens + std::chrono::duration<double>(now - last).count() * rate);
+    last   = now;
+    if (tokens < 1) return false;
+    tokens -= 1;
+    return true;
+  }
+};
+
+struct rate_limit {
+  std::string method;
+  double rate, burst;
+  bool per_client;
+  token_bucket shared;
+  std::unordered_map<void const *, token_bucket> clients;
+};
+
+// With singleFlight() an identical call arriving while the first one is still pending gets that call's ticket
+// instead of running the handler again; everyone waiting is answered on their own reply topic. A joined caller keeps
+// its own deadline and may cancel on its own, the shared call is only cancelled once none of its callers is left.
+struct export_entry {
+  void *fn = nullptr;
+  std::optional<response_cache> cache;
+  bool single_flight = false;
+  std::unordered_map<std::string, uint64_t> flights;
+  priority_class *priority = nullptr;
+  std::optional<rate_limit> limit;
+  size_t stream_window = 0;
+};
+
+// Methods without priority() run inline as they arrive, which keeps control calls such as ping ahead of anything
+// queued. A prioritized call is answered with $pending at once and runs later from the scheduler, which picks among
+// the non-empty classes by smooth weighted round robin and returns to epoll after each slice.
+struct queued_call {
+  uint64_t id;
+  export_entry *entry;
+  void *self;
+  std::string key;
+  json data;
+  std::chrono::steady_clock::time_point queued;
+};
+
+struct priority_class {
+  char const *name;
+  int weight;
+  int current = 0;
+  std::deque<queued_call> calls;
+  uint64_t served = 0;
+  std::chrono::duration<double, std::milli> wait_total{}, wait_max{};
+};
+
+static priority_class priority_classes[] = { { "high", 8 }, { "normal", 4 }, { "low", 1 } };
+constexpr auto scheduler_slice = std::chrono::milliseconds(2);
+
+static unix_file scheduler;
+static bool scheduled;
+
+LOAD_ENV(YSRV_CLIENT_RATE, "0");
+LOAD_ENV(YSRV_CLIENT_BURST, "0");
+LOAD_ENV(YSRV_MAX_INFLIGHT, "0");
+
+static double const client_rate  = std::stod(YSRV_CLIENT_RATE);
+static double const client_burst = std::max({ std::stod(YSRV_CLIENT_BURST), client_rate, 1.0 });
+static size_t const max_inflight = std::stoul(YSRV_MAX_INFLIGHT);
+static std::unordered_map<void const *, token_bucket> client_buckets;
+// connections are not announced when they go away, but a bucket that has refilled is the same as a fresh one
+constexpr size_t bucket_sweep = 4096;
+
+constexpr size_t default_cache_entries = 256;
+
+// exported functions by name, filled from the exports proxy's set trap so a call never goes through the proxy; the
+// proxy target keeps every function reachable, and unordered_map never moves a value once inserted
+static std::unordered_map<std::string, export_entry> exported;
+
+static uint64_t current_ticket(duk_context *ctx) {
+  duk_push_current_function(ctx);
+  duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("ticket"));
+  auto id = (uint64_t)duk_get_number(ctx, -1);
+  duk_pop_2(ctx);
+  return id;
+}
+
+static void forget(std::unordered_map<uint64_t, call_ticket>::iterator it) {
+  if (it->second.state == call_state::cancelled) cancelled_tickets--;
+  if (it->second.context) {
+    duk_get_global_string(heap, DUK_HIDDEN_SYMBOL("contexts"));
+    duk_del_prop_index(heap, -1, (duk_uarridx_t)it->first);
+    duk_pop(heap);
+  }
+  if (it->second.stream) {
+    duk_get_global_string(heap, DUK_HIDDEN_SYMBOL("streams"));
+    duk_del_prop_index(heap, -1, (duk_uarridx_t)it->first);
+    duk_pop(heap);
+  }
+  tickets.erase(it);
+}
+
+static void forget(uint64_t id) {
+  if (auto it = tickets.find(id); it != tickets.end()) forget(it);
+}
+
+// connections are not announced when they go away, so names are never derived from their addresses, which get reused
+static std::string private_topic(char const *prefix, size_t journal) {
+  static std::random_device random;
+  char token[33];
+  snprintf(token, sizeof token, "%08x%08x%08x%08x", random(), random(), random(), random());
+  auto name = prefix + std::string{ token };
+  event_declare(name, { { "journal", journal }, { "private", true } });
+  return name;
+}
+
+static json pending_reply(uint64_t id, call_meta &caller) {
+  if (caller.reply.empty()) caller.reply = private_topic("ysrv.reply.", reply_journal);
+  json ret = { { "$pending", id }, { "$reply", caller.reply } };
+  if (tickets[id].stream) {
+    if (caller.stream.empty()) caller.stream = private_topic("ysrv.stream.", tickets[id].stream->size);
+    ret["$stream"] = caller.stream;
+  }
+  return ret;
+}
+
+static void answer(std::vector<call_meta> const &callers, json const &reply) {
+  for (auto &caller : callers) {
+    if (caller.reply.empty()) continue;
+    event_emit(caller.reply, reply);
+    event_retire(caller.reply);
+    if (!caller.stream.empty()) event_retire(caller.stream);
+  }
+}
+
+static void complete(duk_context *ctx, uint64_t id, duk_idx_t error, duk_idx_t result) {
+  auto it = tickets.find(id);
+  if (it != tickets.end() && it->second.state == call_state::cancelled) return forget(it);
+  if (it == tickets.end() || it->second.state == call_state::replied)
+    duk_error(ctx, DUK_ERR_ERROR, "call %lu already replied", (unsigned long)id);
+  json reply = { { "id", id } };
+  if (error != DUK_INVALID_INDEX)
+    reply["error"] = duk_safe_to_string(ctx, error);
+  else
+    reply["result"] = duk_get_json(ctx, result);
+  if (it->second.stream) reply["chunks"] = it->second.stream->written;
+  if (it->second.state == call_state::running) {
+    it->second.state = call_state::replied;
+    it->second.reply = std::move(reply);
+    return;
+  }
+  if (it->second.done) it->second.done();
+  auto callers = std::move(it->second.callers);
+  forget(it);
+  answer(callers, reply);
+}
+
+static void push_completion(duk_context *ctx, uint64_t id, duk_c_function fn, duk_idx_t nargs) {
+  duk_push_c_function(ctx, fn, nargs);
+  duk_push_number(ctx, (duk_double_t)id);
+  duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("ticket"));
+}
+
+static duk_ret_t reply(duk_context *ctx) {
+  complete(ctx, current_ticket(ctx), duk_is_null_or_undefined(ctx, 0) ? DUK_INVALID_INDEX : 0, 1);
+  return 0;
+}
+
+static duk_ret_t resolve(duk_context *ctx) {
+  complete(ctx, current_ticket(ctx), DUK_INVALID_INDEX, 0);
+  return 0;
+}
+
+static duk_ret_t reject(duk_context *ctx) {
+  complete(ctx, current_ticket(ctx), 0, DUK_INVALID_INDEX);
+  return 0;
+}
+
+static duk_ret_t stream_write(duk_context *ctx) {
+  auto id = current_ticket(ctx);
+  auto it = tickets.find(id);
+  if (it == tickets.end() || it->second.state == call_state::replied)
+    return duk_error(ctx, DUK_ERR_ERROR, "stream %lu already ended", (unsigned long)id);
+  auto &stream = *it->second.stream;
+  if (it->second.state == call_state::cancelled) {
+    duk_push_false(ctx);
+    return 1;
+  }
+  if (!stream.open()) return duk_error(ctx, DUK_ERR_RANGE_ERROR, "stream %lu window is full, wait for ondrain", (unsigned long)id);
+  json chunk = { { "id", id }, { "index", stream.written++ }, { "data", duk_get_json(ctx, 0) } };
+  for (auto &caller : it->second.callers) event_emit(caller.stream, chunk);
+  duk_push_boolean(ctx, stream.open());
+  return 1;
+}
+
+// { id, write(chunk), end([result]), error(reason), ondrain }
+static void push_stream(duk_context *ctx, uint64_t id) {
+  duk_push_object(ctx);
+  duk_push_number(ctx, (duk_double_t)id);
+  duk_put_prop_string(ctx, -2, "id");
+  push_completion(ctx, id, stream_write, 1);
+  duk_put_prop_string(ctx, -2, "write");
+  push_completion(ctx, id, resolve, 1);
+  duk_put_prop_string(ctx, -2, "end");
+  push_completion(ctx, id, reject, 1);
+  duk_put_prop_string(ctx, -2, "error");
+  duk_push_null(ctx);
+  duk_put_prop_string(ctx, -2, "ondrain");
+  duk_get_global_string(ctx, DUK_HIDDEN_SYMBOL("streams"));
+  duk_dup(ctx, -2);
+  duk_put_prop_index(ctx, -2, (duk_uarridx_t)id);
+  duk_pop(ctx);
+}
+
+static void drain(uint64_t id) {
+  duk_get_global_string(heap, DUK_HIDDEN_SYMBOL("streams"));
+  duk_get_prop_index(heap, -1, (duk_uarridx_t)id);
+  duk_get_prop_string(heap, -1, "ondrain");
+  if (duk_is_callable(heap, -1)) {
+    duk_dup(heap, -2);
+    call_scope scope{ id };
+    exec_budget budget{ exec_budget::callback };
+    if (duk_pcall_method(heap, 0) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(heap, -1) << std::endl; }
+  }
+  duk_pop_3(heap);
+  duk_run_jobs(heap);
+}
+
+static bool is_thenable(duk_context *ctx, duk_idx_t idx) {
+  if (!duk_is_object(ctx, idx)) return false;
+  duk_get_prop_string(ctx, idx, "then");
+  auto ret = duk_is_callable(ctx, -1);
+  duk_pop(ctx);
+  return ret;
+}
+
+static json take_reply(uint64_t id) {
+  auto reply = std::move(tickets[id].reply);
+  forget(id);
+  if (reply.contains("error")) throw std::runtime_error(reply["error"].get<std::string>());
+  return std::move(reply["result"]);
+}
+
+static void on_deadline();
+
+static void rearm_deadlines() {
+  itimerspec spec{};
+  if (!deadlines.empty()) {
+    auto at               = deadlines.begin()->first.time_since_epoch();
+    spec.it_value.tv_sec  = std::chrono::duration_cast<std::chrono::seconds>(at).count();
+    spec.it_value.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(at % std::chrono::seconds(1)).count() | 1;
+  }
+  timerfd_settime(deadline_timer, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+// steady_clock is CLOCK_MONOTONIC, so one absolute timerfd follows the earliest deadline of all pending calls
+static void arm_deadline(uint64_t id, deadline_t deadline) {
+  if (deadline == deadline_t::max()) return;
+  if (!deadline_timer) {
+    deadline_timer      = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    static auto handler = holder<std::shared_ptr<epoll>>()->reg([](const epoll_event &) { on_deadline(); });
+    holder<std::shared_ptr<epoll>>()->add(EPOLLIN, deadline_timer, handler);
+  }
+  auto first = deadlines.empty() || deadline < deadlines.begin()->first;
+  deadlines.emplace(deadline, id);
+  if (first) rearm_deadlines();
+}
+
+static bool cancel(uint64_t id, char const *reason) {
+  auto it = tickets.find(id);
+  if (it == tickets.end() || it->second.state != call_state::pending) return false;
+  auto callers     = it->second.callers;
+  it->second.state = call_state::cancelled;
+  cancelled_tickets++;
+  if (auto done = std::move(it->second.done)) done();
+  // the handler may reply from oncancel, which drops the ticket
+  if (it->second.context) {
+    duk_get_global_string(heap, DUK_HIDDEN_SYMBOL("contexts"));
+    duk_get_prop_index(heap, -1, (duk_uarridx_t)id);
+    duk_get_prop_string(heap, -1, "oncancel");
+    if (duk_is_callable(heap, -1)) {
+      duk_dup(heap, -2);
+      duk_push_string(heap, reason);
+      exec_budget budget{ exec_budget::callback };
+      if (duk_pcall_method(heap, 1) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(heap, -1) << std::endl; }
+    }
+    duk_pop_3(heap);
+  }
+  answer(callers, { { "id", id }, { "error", reason } });
+  duk_run_jobs(heap);
+  return true;
+}
+
+// answers the callers gone() picks with reason and detaches them, or cancels the call if that is all of them
+template <typename F> static bool leave(uint64_t id, F &&gone, char const *reason) {
+  auto it = tickets.find(id);
+  if (it == tickets.end() || it->second.state != call_state::pending) return false;
+  auto &ticket  = it->second;
+  auto &callers = ticket.callers;
+  auto staying  = std::partition(callers.begin(), callers.end(), [&](call_meta const &caller) { return !gone(caller); });
+  if (staying == callers.end()) return false;
+  if (staying == callers.begin()) return cancel(id, reason);
+  std::vector<call_meta> leaving(staying, callers.end());
+  callers.erase(staying, callers.end());
+  ticket.meta.deadline = std::max_element(callers.begin(), callers.end(), [](auto &a, auto &b) { return a.deadline < b.deadline; })->deadline;
+  answer(leaving, { { "id", id }, { "error", reason } });
+  return true;
+}
+
+static void on_deadline() {
+  uint64_t tmp;
+  read(deadline_timer, &tmp, sizeof tmp);
+  auto now = std::chrono::steady_clock::now();
+  while (!deadlines.empty() && deadlines.begin()->first <= now) {
+    auto id = deadlines.begin()->second;
+    deadlines.erase(deadlines.begin());
+    leave(id, [&](call_meta const &caller) { return caller.deadline <= now; }, "deadline exceeded");
+  }
+  rearm_deadlines();
+}
+
+static duk_ret_t context_cancelled(duk_context *ctx) {
+  auto it = tickets.find(current_ticket(ctx));
+  duk_push_boolean(ctx, it != tickets.end() &&
+                            (it->second.state == call_state::cancelled || std::chrono::steady_clock::now() >= it->second.meta.deadline));
+  return 1;
+}
+
+static duk_ret_t context_remaining(duk_context *ctx) {
+  auto it = tickets.find(current_ticket(ctx));
+  if (it == tickets.end() || it->second.state == call_state::cancelled) {
+    duk_push_number(ctx, 0);
+  } else if (it->second.meta.deadline == deadline_t::max()) {
+    duk_push_number(ctx, INFINITY);
+  } else {
+    auto left = std::chrono::duration<double, std::milli>(it->second.meta.deadline - std::chrono::steady_clock::now()).count();
+    duk_push_number(ctx, std::max(left, 0.0));
+  }
+  return 1;
+}
+
+// { id, caller, deadline (epoch ms or null), cancelled, remaining(), oncancel }
+static void push_context(duk_context *ctx, uint64_t id, call_meta const &meta) {
+  char caller[32];
+  snprintf(caller, sizeof caller, "%p", meta.caller);
+  duk_push_object(ctx);
+  duk_push_number(ctx, (duk_double_t)id);
+  duk_put_prop_string(ctx, -2, "id");
+  duk_push_string(ctx, caller);
+  duk_put_prop_string(ctx, -2, "caller");
+  if (meta.deadline == deadline_t::max()) {
+    duk_push_null(ctx);
+  } else {
+    auto left = meta.deadline - std::chrono::steady_clock::now();
+    duk_push_number(ctx, std::chrono::duration<double, std::milli>((std::chrono::system_clock::now() + left).time_since_epoch()).count());
+  }
+  duk_put_prop_string(ctx, -2, "deadline");
+  duk_push_string(ctx, "cancelled");
+  push_completion(ctx, id, context_cancelled, 0);
+  duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_GETTER | DUK_DEFPROP_SET_ENUMERABLE);
+  push_completion(ctx, id, context_remaining, 0);
+  duk_put_prop_string(ctx, -2, "remaining");
+  duk_push_null(ctx);
+  duk_put_prop_string(ctx, -2, "oncancel");
+  duk_get_global_string(ctx, DUK_HIDDEN_SYMBOL("contexts"));
+  duk_dup(ctx, -2);
+  duk_put_prop_index(ctx, -2, (duk_uarridx_t)id);
+  duk_pop(ctx);
+}
+
+call_scope::call_scope(uint64_t id)
+    : saved(current_call) {
+  current_call = id;
+}
+
+call_scope::~call_scope() { current_call = saved; }
+
+uint64_t call_scope::current() { return current_call; }
+
+double call_scope::remaining_ms() {
+  auto it = tickets.find(current_call);
+  if (it == tickets.end() || it->second.meta.deadline == deadline_t::max()) return -1;
+  if (it->second.state == call_state::cancelled) return 0;
+  return std::max(std::chrono::duration<double, std::milli>(it->second.meta.deadline - std::chrono::steady_clock::now()).count(), 0.0);
+}
+
+// runs [fn this] on the stack under the ticket id, which has to exist
+// chunks receives how many chunks a streaming call wrote before it returned
+static json call_ticketed(duk_context *ctx, uint64_t id, json data, uint64_t *chunks = nullptr) {
+  // an export assigned a primitive has no heap pointer and pushes undefined, which no property read may touch
+  if (!duk_is_callable(ctx, -2)) {
+    duk_pop_2(ctx);
+    forget(id);
+    throw std::runtime_error("TypeError: export is not callable");
+  }
+  auto meta = tickets[id].meta;
+  auto now  = std::chrono::steady_clock::now();
+  if (now >= meta.deadline) {
+    forget(id);
+    throw std::runtime_error("deadline exceeded");
+  }
+  // the handler and everything it settles synchronously share one budget, budget(ms, fn) overrides the default and
+  // the call's own deadline caps both
+  auto ms = exec_budget::of(ctx, -2, exec_budget::call);
+  if (meta.deadline != deadline_t::max()) {
+    auto left = std::max<int64_t>(std::chrono::ceil<std::chrono::milliseconds>(meta.deadline - now).count(), 1);
+    if (!ms || left < ms) ms = left;
+  }
+  exec_budget budget{ ms };
+  call_scope scope{ id };
+  tickets[id].state = call_state::running;
+  // a handler taking (params, reply) that returns nothing answers later through reply, a third parameter gets the context
+  duk_get_prop_string(ctx, -2, "length");
+  auto params      = duk_get_int(ctx, -1);
+  auto takes_reply = params >= 2;
+  duk_pop(ctx);
+  duk_push_json(ctx, std::move(data));
+  if (tickets[id].stream)
+    push_stream(ctx, id);
+  else
+    push_completion(ctx, id, reply, 2);
+  if (params >= 3) {
+    push_context(ctx, id, meta);
+    tickets[id].context = true;
+  }
+  if (duk_pcall_method(ctx, params >= 3 ? 3 : 2) != DUK_EXEC_SUCCESS) {
+    forget(id);
+    std::string message = duk_safe_to_string(ctx, -1);
+    duk_pop(ctx);
+    throw std::runtime_error(message);
+  }
+  duk_run_jobs(ctx);
+  auto pending = takes_reply && duk_is_undefined(ctx, -1);
+  if (tickets[id].state == call_state::running && is_thenable(ctx, -1)) {
+    duk_push_string(ctx, "then");
+    push_completion(ctx, id, resolve, 1);
+    push_completion(ctx, id, reject, 1);
+    if (duk_pcall_prop(ctx, -4, 2) != DUK_EXEC_SUCCESS) {
+      forget(id);
+      std::string message = duk_safe_to_string(ctx, -1);
+      duk_pop_2(ctx);
+      throw std::runtime_error(message);
+    }
+    duk_pop(ctx);
+    // a promise that is already settled answers through its reactions right here
+    duk_run_jobs(ctx);
+    pending = true;
+  }
+  auto &ticket = tickets[id];
+  if (chunks && ticket.stream) *chunks = ticket.stream->written;
+  if (ticket.state == call_state::replied) {
+    duk_pop(ctx);
+    return take_reply(id);
+  }
+  if (pending) {
+    duk_pop(ctx);
+    ticket.state = call_state::pending;
+    arm_deadline(id, meta.deadline);
+    return pending_reply(id, ticket.callers.front());
+  }
+  forget(id);
+  auto ret = duk_get_json(ctx, -1);
+  duk_pop(ctx);
+  return ret;
+}
+
+static json call_export(duk_context *ctx, call_meta const &meta, json data) {
+  auto id = ++last_ticket;
+  tickets.emplace(id, call_ticket{ .meta = meta, .callers = { meta } });
+  return call_ticketed(ctx, id, std::move(data));
+}
+
+json duk_call_export(duk_context *ctx, json data) { return call_export(ctx, {}, std::move(data)); }
+
+static bool is_pending(json const &reply) { return reply.is_object() && reply.contains("$pending"); }
+
+static void remember(export_entry &entry, std::string key, json const &reply) {
+  if (!entry.cache || !entry.cache->capacity) return;
+  auto &cache  = *entry.cache;
+  auto expires = std::chrono::steady_clock::now() + cache.ttl;
+  // identical queued calls both finish here, the second one refreshes the entry the first one made
+  if (auto it = cache.entries.find(key); it != cache.entries.end()) {
+    auto hit     = it->second;
+    hit->expires = expires;
+    hit->reply   = reply;
+    cache.recency.splice(cache.recency.begin(), cache.recency, hit);
+    return;
+  }
+  if (cache.recency.size() == cache.capacity) {
+    cache.entries.erase(cache.recency.back().key);
+    cache.recency.pop_back();
+  }
+  cache.recency.push_front({ std::move(key), expires, reply });
+  cache.entries.emplace(cache.recency.front().key, cache.recency.begin());
+}
+
+static void run_queued(duk_context *ctx, queued_call &call) {
+  // a call cancelled while it waited has been answered already
+  auto it = tickets.find(call.id);
+  if (it->second.state == call_state::cancelled) return forget(it);
+  auto done    = std::move(it->second.done);
+  auto callers = it->second.callers;
+  json reply = { { "id", call.id } };
+  uint64_t chunks = 0;
+  try {
+    duk_push_heapptr(ctx, call.entry->fn);
+    duk_push_heapptr(ctx, call.self);
+    auto ret = call_ticketed(ctx, call.id, std::move(call.data), &chunks);
+    if (is_pending(ret)) {
+      tickets[call.id].done = std::move(done);
+      return;
+    }
+    remember(*call.entry, std::move(call.key), ret);
+    reply["result"] = std::move(ret);
+    if (call.entry->stream_window) reply["chunks"] = chunks;
+  } catch (std::exception &e) { reply["error"] = e.what(); }
+  if (done) done();
+  answer(callers, reply);
+}
+
+static priority_class *next_class() {
+  priority_class *ret = nullptr;
+  int total           = 0;
+  for (auto &cls : priority_classes) {
+    if (cls.calls.empty()) continue;
+    cls.current += cls.weight;
+    total += cls.weight;
+    if (!ret || cls.current > ret->current) ret = &cls;
+  }
+  if (ret) ret->current -= total;
+  return ret;
+}
+
+static void schedule() {
+  if (scheduled) return;
+  uint64_t one = 1;
+  write(scheduler, &one, sizeof one);
+  scheduled = true;
+}
+
+static void on_schedule(duk_context *ctx) {
+  uint64_t tmp;
+  read(scheduler, &tmp, sizeof tmp);
+  scheduled = false;
+  auto end  = std::chrono::steady_clock::now() + scheduler_slice;
+  while (auto cls = next_class()) {
+    auto call = std::move(cls->calls.front());
+    cls->calls.pop_front();
+    auto now  = std::chrono::steady_clock::now();
+    auto wait = std::chrono::duration<double, std::milli>(now - call.queued);
+    cls->served++;
+    cls->wait_total += wait;
+    cls->wait_max = std::max(cls->wait_max, wait);
+    run_queued(ctx, call);
+    if (std::chrono::steady_clock::now() >= end) break;
+  }
+  for (auto &cls : priority_classes)
+    if (!cls.calls.empty()) return schedule();
+}
+
+static json enqueue(duk_context *ctx, export_entry &entry, void *self, call_meta const &meta, std::string key, json data) {
+  if (!scheduler) {
+    scheduler           = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    static auto handler = holder<std::shared_ptr<epoll>>()->reg([ctx](const epoll_event &) { on_schedule(ctx); });
+    holder<std::shared_ptr<epoll>>()->add(EPOLLIN, scheduler, handler);
+  }
+  auto id = ++last_ticket;
+  tickets.emplace(id, call_ticket{ .state = call_state::pending, .meta = meta, .callers = { meta } });
+  if (entry.stream_window) tickets[id].stream = stream_window{ .size = entry.stream_window };
+  entry.priority->calls.push_back({ id, &entry, self, std::move(key), std::move(data), std::chrono::steady_clock::now() });
+  arm_deadline(id, meta.deadline);
+  schedule();
+  return pending_reply(id, tickets[id].callers.front());
+}
+
+static bool take_token(std::unordered_map<void const *, token_bucket> &buckets, void const *client, double rate, double burst,
+                       std::chrono::steady_clock::time_point now) {
+  if (buckets.size() >= bucket_sweep)
+    std::erase_if(buckets, [&](auto &it) { return it.second.tokens + std::chrono::duration<double>(now - it.second.last).count() * rate >= burst; });
+  auto [it, inserted] = buckets.try_emplace(client, token_bucket{ burst, now });
+  return it->second.take(rate, burst, now);
+}
+
+static void admit(export_entry &entry, void const *client) {
+  if (!client_rate && !entry.limit) return;
+  auto now = std::chrono::steady_clock::now();
+  if (client_rate && !take_token(client_buckets, client, client_rate, client_burst, now))
+    throw std::runtime_error("rate limited: too many calls from this connection");
+  if (!entry.limit) return;
+  auto &limit = *entry.limit;
+  if (limit.per_client ? !take_token(limit.clients, client, limit.rate, limit.burst, now) : !limit.shared.take(limit.rate, limit.burst, now))
+    throw std::runtime_error("rate limited: too many calls to " + limit.method);
+}
+
+static void shed() {
+  auto inflight = tickets.size() - cancelled_tickets;
+  if (max_inflight && inflight >= max_inflight) throw std::runtime_error("overloaded: " + std::to_string(inflight) + " calls in flight");
+}
+
+static json queue_stats() {
+  json ret = json::object();
+  auto now = std::chrono::steady_clock::now();
+  for (auto &cls : priority_classes) {
+    auto oldest   = cls.calls.empty() ? now : cls.calls.front().queued;
+    ret[cls.name] = {
+      { "weight", cls.weight },
+      { "depth", cls.calls.size() },
+      { "served", cls.served },
+      { "waitAvgMs", cls.served ? cls.wait_total.count() / cls.served : 0 },
+      { "waitMaxMs", cls.wait_max.count() },
+      { "oldestMs", std::chrono::duration<double, std::milli>(now - oldest).count() },
+    };
+  }
+  return ret;
+}
+
+bool export_define(duk_context *ctx, std::string const &name, duk_idx_t idx) {
+  auto [it, inserted] = exported.try_emplace(name);
+  auto &entry         = it->second;
+  entry.fn            = duk_get_heapptr(ctx, idx);
+  entry.cache.reset();
+  entry.flights.clear();
+  entry.single_flight = false;
+  entry.priority      = nullptr;
+  entry.limit.reset();
+  entry.stream_window = 0;
+  if (!duk_is_function(ctx, idx)) return inserted;
+  duk_get_prop_string(ctx, idx, DUK_HIDDEN_SYMBOL("singleFlight"));
+  entry.single_flight = duk_to_boolean(ctx, -1);
+  duk_get_prop_string(ctx, idx, DUK_HIDDEN_SYMBOL("priority"));
+  if (duk_is_number(ctx, -1)) entry.priority = &priority_classes[duk_get_uint(ctx, -1)];
+  duk_pop_2(ctx);
+  if (duk_get_prop_string(ctx, idx, DUK_HIDDEN_SYMBOL("rateLimit"))) {
+    duk_get_prop_string(ctx, -1, "rate");
+    duk_get_prop_string(ctx, -2, "burst");
+    duk_get_prop_string(ctx, -3, "perClient");
+    auto rate  = duk_get_number(ctx, -3);
+    auto burst = duk_get_number(ctx, -2);
+    entry.limit.emplace(rate_limit{ name, rate, burst, (bool)duk_to_boolean(ctx, -1), { burst, std::chrono::steady_clock::now() } });
+    duk_pop_3(ctx);
+  }
+  duk_pop(ctx);
+  if (duk_get_prop_string(ctx, idx, DUK_HIDDEN_SYMBOL("cache"))) {
+    duk_get_prop_string(ctx, -1, "ttlMs");
+    duk_get_prop_string(ctx, -2, "maxEntries");
+    entry.cache.emplace();
+    entry.cache->ttl      = std::chrono::milliseconds((int64_t)duk_get_number(ctx, -2));
+    entry.cache->capacity = duk_get_uint_default(ctx, -1, default_cache_entries);
+    duk_pop_2(ctx);
+  }
+  duk_pop(ctx);
+  // a stream has to start after its caller knows the id, so streaming calls always go through the scheduler, and
+  // only their final result would be cached
+  duk_get_prop_string(ctx, idx, DUK_HIDDEN_SYMBOL("streaming"));
+  if (duk_is_number(ctx, -1)) {
+    entry.stream_window = duk_get_uint(ctx, -1);
+    entry.cache.reset();
+    if (!entry.priority) entry.priority = &priority_classes[1];
+  }
+  duk_pop(ctx);
+  return inserted;
+}
+
+export_entry &export_slot(std::string const &name) { return exported[name]; }
+
+// a caller sets its deadline with $timeoutMs in the params, relative so that clock skew between hosts does not matter
+static call_meta take_meta(void const *client, json &data) {
+  call_meta ret{ client };
+  if (!data.is_object()) return ret;
+  auto it = data.find("$timeoutMs");
+  if (it == data.end()) return ret;
+  if (it->is_number())
+    ret.deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                          std::chrono::duration<double, std::milli>(std::max(it->get<double>(), 0.0)));
+  data.erase(it);
+  return ret;
+}
+
+// the shared call runs for as long as its latest caller is willing to wait
+static json join(uint64_t id, call_meta const &meta) {
+  auto &ticket = tickets[id];
+  auto it      = std::find_if(ticket.callers.begin(), ticket.callers.end(), [&](call_meta const &caller) { return caller.caller == meta.caller; });
+  if (it == ticket.callers.end())
+    it = ticket.callers.insert(it, meta);
+  else
+    it->deadline = std::max(it->deadline, meta.deadline);
+  ticket.meta.deadline = std::max(ticket.meta.deadline, meta.deadline);
+  arm_deadline(id, meta.deadline);
+  return pending_reply(id, *it);
+}
+
+json export_dispatch(duk_context *ctx, export_entry &entry, void *self, void const *client, json data) {
+  admit(entry, client);
+  auto meta = take_meta(client, data);
+  if (!entry.cache && !entry.single_flight && !entry.priority) {
+    shed();
+    duk_push_heapptr(ctx, entry.fn);
+    duk_push_heapptr(ctx, self);
+    return call_export(ctx, meta, std::move(data));
+  }
+  auto key = data.dump();
+  if (entry.cache) {
+    auto &cache = *entry.cache;
+    if (auto it = cache.entries.find(key); it != cache.entries.end()) {
+      auto hit = it->second;
+      if (hit->expires > std::chrono::steady_clock::now()) {
+        cache.recency.splice(cache.recency.begin(), cache.recency, hit);
+        return hit->reply;
+      }
+      cache.entries.erase(it);
+      cache.recency.erase(hit);
+    }
+  }
+  if (auto it = entry.flights.find(key); it != entry.flights.end()) return join(it->second, meta);
+  shed();
+  json reply;
+  if (entry.priority) {
+    reply = enqueue(ctx, entry, self, meta, key, std::move(data));
+  } else {
+    duk_push_heapptr(ctx, entry.fn);
+    duk_push_heapptr(ctx, self);
+    reply = call_export(ctx, meta, std::move(data));
+  }
+  // errors throw past this point, and a $pending ticket can only be shared while it is in flight
+  if (is_pending(reply)) {
+    if (entry.single_flight) {
+      auto id = reply["$pending"].get<uint64_t>();
+      entry.flights.emplace(key, id);
+      tickets[id].done = [&entry, key] { entry.flights.erase(key); };
+    }
+    return reply;
+  }
+  remember(entry, std::move(key), reply);
+  return reply;
+}
+
+void init_duk_exports(duk_context *ctx) {
+  heap = ctx;
+  duk_push_bare_object(ctx);
+  duk_put_global_string(ctx, DUK_HIDDEN_SYMBOL("contexts"));
+  duk_push_c_function(
+      ctx,
+      +[](duk_context *ctx) -> duk_ret_t {
+        duk_require_object(ctx, 0);
+        duk_require_function(ctx, 1);
+        duk_get_prop_string(ctx, 0, "ttlMs");
+        duk_get_prop_string(ctx, 0, "maxEntries");
+        if (!duk_is_number(ctx, -2) || duk_get_number(ctx, -2) <= 0) return duk_range_error(ctx, "ttlMs must be a positive number");
+        if (!duk_is_undefined(ctx, -1) && (!duk_is_number(ctx, -1) || duk_get_number(ctx, -1) < 0))
+          return duk_range_error(ctx, "maxEntries must be a non-negative number");
+        duk_push_bare_object(ctx);
+        duk_swap(ctx, -3, -1);
+        duk_put_prop_string(ctx, -3, "ttlMs");
+        duk_put_prop_string(ctx, -2, "maxEntries");
+        duk_push_wrapper(ctx, 1);
+        duk_swap_top(ctx, -2);
+        duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("cache"));
+        return 1;
+      },
+      2);
+  duk_put_global_string(ctx, "cached");
+  duk_push_c_function(
+      ctx,
+      +[](duk_context *ctx) -> duk_ret_t {
+        duk_require_function(ctx, 0);
+        duk_push_wrapper(ctx, 0);
+        duk_push_true(ctx);
+        duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("singleFlight"));
+        return 1;
+      },
+      1);
+  duk_put_global_string(ctx, "singleFlight");
+  duk_push_c_function(
+      ctx,
+      +[](duk_context *ctx) -> duk_ret_t {
+        std::string_view name = duk_require_string(ctx, 0);
+        duk_require_function(ctx, 1);
+        for (auto &cls : priority_classes) {
+          if (cls.name != name) continue;
+          duk_push_wrapper(ctx, 1);
+          duk_push_uint(ctx, &cls - priority_classes);
+          duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("priority"));
+          return 1;
+        }
+        return duk_range_error(ctx, "unknown priority class %s", name.data());
+      },
+      2);
+  duk_put_global_string(ctx, "priority");
+  duk_push_c_function(
+      ctx,
+      +[](duk_context *ctx) -> duk_ret_t {
+        duk_require_object(ctx, 0);
+        duk_require_function(ctx, 1);
+        duk_get_prop_string(ctx, 0, "rate");
+        duk_get_prop_string(ctx, 0, "burst");
+        duk_get_prop_string(ctx, 0, "perClient");
+        if (!duk_is_number(ctx, -3) || duk_get_number(ctx, -3) <= 0) return duk_range_error(ctx, "rate must be a positive number");
+        auto burst = duk_is_undefined(ctx, -2) ? std::max(duk_get_number(ctx, -3), 1.0) : duk_get_number(ctx, -2);
+        if (!duk_is_undefined(ctx, -2) && (!duk_is_number(ctx, -2) || burst < 1)) return duk_range_error(ctx, "burst must be at least 1");
+        auto rate       = duk_get_number(ctx, -3);
+        auto per_client = duk_to_boolean(ctx, -1);
+        duk_push_bare_object(ctx);
+        duk_push_number(ctx, rate);
+        duk_put_prop_string(ctx, -2, "rate");
+        duk_push_number(ctx, burst);
+        duk_put_prop_string(ctx, -2, "burst");
+        duk_push_boolean(ctx, per_client);
+        duk_put_prop_string(ctx, -2, "perClient");
+        duk_push_wrapper(ctx, 1);
+        duk_swap_top(ctx, -2);
+        duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("rateLimit"));
+        return 1;
+      },
+      2);
+  duk_put_global_string(ctx, "rateLimit");
+  duk_push_bare_object(ctx);
+  duk_put_global_string(ctx, DUK_HIDDEN_SYMBOL("streams"));
+  duk_push_c_function(
+      ctx,
+      +[](duk_context *ctx) -> duk_ret_t {
+        auto window = default_window;
+        if (!duk_is_function(ctx, 0)) {
+          duk_require_object(ctx, 0);
+          duk_get_prop_string(ctx, 0, "window");
+          if (!duk_is_undefined(ctx, -1) && (!duk_is_number(ctx, -1) || duk_get_number(ctx, -1) < 1 || duk_get_number(ctx, -1) > max_window))
+            return duk_range_error(ctx, "window must be between 1 and %u", (unsigned)max_window);
+          window = duk_get_uint_default(ctx, -1, default_window);
+          duk_pop(ctx);
+          duk_remove(ctx, 0);
+        }
+        duk_require_function(ctx, 0);
+        duk_push_wrapper(ctx, 0);
+        duk_push_uint(ctx, window);
+        duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("streaming"));
+        return 1;
+      },
+      DUK_VARARGS);
+  duk_put_global_string(ctx, "streaming");
+}
+
+void init_exports() {
+  holder<rpcws::RPC>()->reg("ysrv.queues", [](auto, json) -> json { return queue_stats(); });
+  // a connection can only withdraw itself from a call, which is cancelled once no caller is left
+  holder<rpcws::RPC>()->reg("ysrv.cancel", [](auto const &client, json params) -> json {
+    auto identity = client_identity(client);
+    return leave(params.at("id").get<uint64_t>(), [&](call_meta const &caller) { return caller.caller == identity; }, "cancelled");
+  });
+  // { id, index } acknowledges every chunk up to and including index
+  holder<rpcws::RPC>()->reg("ysrv.ack", [](auto const &client, json params) -> json {
+    auto id = params.at("id").get<uint64_t>();
+    auto it = tickets.find(id);
+    auto identity = client_identity(client);
+    if (it == tickets.end() || !it->second.stream ||
+        std::none_of(it->second.callers.begin(), it->second.callers.end(), [&](call_meta const &caller) { return caller.caller == identity; }))
+      return false;
+    auto &stream = *it->second.stream;
+    auto was     = stream.open();
+    stream.acked = std::clamp(params.at("index").get<uint64_t>() + 1, stream.acked, stream.written);
+    if (!was && stream.open() && it->second.state == call_state::pending) drain(id);
+    return true;
+  });
+}
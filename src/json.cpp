@@ -0,0 +1,290 @@
+#include "lib.h"
+
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <duktape.h>
+#include <string>
+#include <string_view>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static void *builtin_parse;
+
+static inline bool is_ws(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+
+static inline char const *skip_ws(char const *p, char const *end) {
+  if (p == end || !is_ws(*p)) return p;
+#if defined(__SSE2__)
+  auto const sp = _mm_set1_epi8(' '), lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r'), tab = _mm_set1_epi8('\t');
+  for (; end - p >= 16; p += 16) {
+    auto v  = _mm_loadu_si128((__m128i const *)p);
+    auto ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, lf)), _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, tab)));
+    if (auto mask = ~_mm_movemask_epi8(ws) & 0xFFFF) return p + __builtin_ctz(mask);
+  }
+#endif
+  while (p != end && is_ws(*p)) p++;
+  return p;
+}
+
+// first byte that ends the verbatim part of a JSON string: '"', '\\' or a control character
+static inline char const *scan_string(char const *p, char const *end) {
+#if defined(__SSE2__)
+  auto const quote = _mm_set1_epi8('"'), slash = _mm_set1_epi8('\\'), ctrl = _mm_set1_epi8(0x1F);
+  for (; end - p >= 16; p += 16) {
+    auto v = _mm_loadu_si128((__m128i const *)p);
+    auto m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, slash)), _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v));
+    if (auto mask = _mm_movemask_epi8(m)) return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p != end; p++) {
+    auto c = (unsigned char)*p;
+    if (c == '"' || c == '\\' || c < 0x20) return p;
+  }
+  return end;
+}
+
+struct json_decoder {
+  duk_context *ctx;
+  char const *begin, *p, *end;
+  std::string scratch;
+  int depth = 0;
+
+  [[noreturn]] void fail() {
+    duk_syntax_error(ctx, "invalid json (at offset %ld)", (long)(p - begin));
+    __builtin_unreachable();
+  }
+
+  void expect(char const *lit, size_t len) {
+    if ((size_t)(end - p) < len || memcmp(p, lit, len) != 0) fail();
+    p += len;
+  }
+
+  // Duktape keeps strings as CESU-8, so surrogates are encoded one by one, same as the builtin decoder does
+  static char *push_codeunit(char *out, unsigned cp) {
+    if (cp < 0x80) {
+      *out++ = (char)cp;
+    } else if (cp < 0x800) {
+      *out++ = (char)(0xC0 | (cp >> 6));
+      *out++ = (char)(0x80 | (cp & 0x3F));
+    } else {
+      *out++ = (char)(0xE0 | (cp >> 12));
+      *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+      *out++ = (char)(0x80 | (cp & 0x3F));
+    }
+    return out;
+  }
+
+  unsigned hex4() {
+    if (end - p < 4) fail();
+    unsigned cp = 0;
+    for (int i = 0; i < 4; i++) {
+      auto c = *p++;
+      cp <<= 4;
+      if (c >= '0' && c <= '9')
+        cp |= c - '0';
+      else if (c >= 'a' && c <= 'f')
+        cp |= c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F')
+        cp |= c - 'A' + 10;
+      else
+        fail();
+    }
+    return cp;
+  }
+
+  std::string_view string() {
+    auto start = ++p;
+    auto q     = scan_string(p, end);
+    if (q != end && *q == '"') {
+      p = q + 1;
+      return { start, (size_t)(q - start) };
+    }
+    // unescaped output never exceeds the input, so write through a raw pointer and trim at the end
+    scratch.resize(end - start);
+    auto out = scratch.data();
+    memcpy(out, start, q - start);
+    out += q - start;
+    p = q;
+    for (;;) {
+      if (p == end || (unsigned char)*p < 0x20) fail();
+      if (*p++ == '"') break;
+      if (p == end) fail();
+      switch (*p++) {
+      case '"': *out++ = '"'; break;
+      case '\\': *out++ = '\\'; break;
+      case '/': *out++ = '/'; break;
+      case 'b': *out++ = '\b'; break;
+      case 'f': *out++ = '\f'; break;
+      case 'n': *out++ = '\n'; break;
+      case 'r': *out++ = '\r'; break;
+      case 't': *out++ = '\t'; break;
+      case 'u': out = push_codeunit(out, hex4()); break;
+      default: p--; fail();
+      }
+      q = scan_string(p, end);
+      memcpy(out, p, q - p);
+      out += q - p;
+      p = q;
+    }
+    return { scratch.data(), (size_t)(out - scratch.data()) };
+  }
+
+  void number() {
+    auto start = p;
+    bool neg   = *p == '-';
+    if (neg) p++;
+    if (p == end) fail();
+    if (*p == '0')
+      p++;
+    else if (*p >= '1' && *p <= '9')
+      while (p != end && *p >= '0' && *p <= '9') p++;
+    else
+      fail();
+    bool integral = true;
+    if (p != end && *p == '.') {
+      integral = false;
+      if (++p == end || *p < '0' || *p > '9') fail();
+      while (p != end && *p >= '0' && *p <= '9') p++;
+    }
+    if (p != end && (*p == 'e' || *p == 'E')) {
+      integral = false;
+      if (++p != end && (*p == '+' || *p == '-')) p++;
+      if (p == end || *p < '0' || *p > '9') fail();
+      while (p != end && *p >= '0' && *p <= '9') p++;
+    }
+    if (integral && p - start <= 16) {
+      int64_t value = 0;
+      for (auto q = start + neg; q != p; q++) value = value * 10 + (*q - '0');
+      if (neg)
+        duk_push_number(ctx, value ? (duk_double_t)-value : -0.0);
+      else
+        duk_push_number(ctx, (duk_double_t)value);
+      return;
+    }
+    double value;
+    if (auto [ptr, ec] = std::from_chars(start, p, value); ec != std::errc{}) value = strtod(start, nullptr);
+    duk_push_number(ctx, value);
+  }
+
+  void array() {
+    if (++depth > DUK_USE_JSON_DEC_RECLIMIT) duk_range_error(ctx, "json decode recursion limit");
+    duk_require_stack(ctx, 4);
+    p++;
+    duk_push_array(ctx);
+    p = skip_ws(p, end);
+    if (p != end && *p == ']') {
+      p++;
+      depth--;
+      return;
+    }
+    for (duk_uarridx_t idx = 0;; idx++) {
+      value();
+      duk_put_prop_index(ctx, -2, idx);
+      p = skip_ws(p, end);
+      if (p == end) fail();
+      if (*p == ',') {
+        p++;
+        continue;
+      }
+      if (*p != ']') fail();
+      p++;
+      break;
+    }
+    depth--;
+  }
+
+  void object() {
+    if (++depth > DUK_USE_JSON_DEC_RECLIMIT) duk_range_error(ctx, "json decode recursion limit");
+    duk_require_stack(ctx, 4);
+    p++;
+    duk_push_object(ctx);
+    p = skip_ws(p, end);
+    if (p != end && *p == '}') {
+      p++;
+      depth--;
+      return;
+    }
+    for (;;) {
+      p = skip_ws(p, end);
+      if (p == end || *p != '"') fail();
+      auto key   = string();
+      auto proto = key == "__proto__";
+      duk_push_lstring(ctx, key.data(), key.size());
+      p = skip_ws(p, end);
+      if (p == end || *p != ':') fail();
+      p++;
+      value();
+      if (proto)
+        duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_SET_WEC);
+      else
+        duk_put_prop(ctx, -3);
+      p = skip_ws(p, end);
+      if (p == end) fail();
+      if (*p == ',') {
+        p++;
+        continue;
+      }
+      if (*p != '}') fail();
+      p++;
+      break;
+    }
+    depth--;
+  }
+
+  void value() {
+    p = skip_ws(p, end);
+    if (p == end) fail();
+    switch (*p) {
+    case '{': object(); break;
+    case '[': array(); break;
+    case '"': {
+      auto str = string();
+      duk_push_lstring(ctx, str.data(), str.size());
+    } break;
+    case 't':
+      expect("true", 4);
+      duk_push_true(ctx);
+      break;
+    case 'f':
+      expect("false", 5);
+      duk_push_false(ctx);
+      break;
+    case 'n':
+      expect("null", 4);
+      duk_push_null(ctx);
+      break;
+    default: number();
+    }
+  }
+};
+
+void init_duk_json(duk_context *ctx) {
+  duk_get_global_string(ctx, "JSON");
+  duk_get_prop_string(ctx, -1, "parse");
+  builtin_parse = duk_get_heapptr(ctx, -1);
+  duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("parse"));
+  duk_function_list_entry funcs[] = {
+    { "parse",
+      +[](duk_context *ctx) -> duk_ret_t {
+        if (duk_is_callable(ctx, 1)) {
+          duk_push_heapptr(ctx, builtin_parse);
+          duk_insert(ctx, 0);
+          duk_call(ctx, 2);
+          return 1;
+        }
+        duk_size_t len;
+        auto src = duk_to_lstring(ctx, 0, &len);
+        json_decoder decoder{ ctx, src, src, src + len };
+        decoder.value();
+        decoder.p = skip_ws(decoder.p, decoder.end);
+        if (decoder.p != decoder.end) decoder.fail();
+        return 1;
+      },
+      2 },
+    { nullptr, nullptr, 0 },
+  };
+  duk_put_function_list(ctx, -1, funcs);
+  duk_pop(ctx);
+}
@@ -1,6 +1,8 @@
 #include "lib.h"
+#include "pending.h"
 #include "utils.h"
 
+#include <array>
 #include <duktape.h>
 #include <epoll.hpp>
 #include <fcntl.h>
@@ -34,8 +36,67 @@
 
 namespace fs = std::filesystem;
 
+static char const base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static std::string base64_encode(unsigned char const *data, size_t len) {
+  std::string ret;
+  ret.reserve((len + 2) / 3 * 4);
+  size_t i = 0;
+  for (; i + 3 <= len; i += 3) {
+    uint32_t v = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+    ret += base64_chars[v >> 18];
+    ret += base64_chars[(v >> 12) & 63];
+    ret += base64_chars[(v >> 6) & 63];
+    ret += base64_chars[v & 63];
+  }
+  if (i < len) {
+    uint32_t v = data[i] << 16 | (i + 1 < len ? data[i + 1] << 8 : 0);
+    ret += base64_chars[v >> 18];
+    ret += base64_chars[(v >> 12) & 63];
+    ret += i + 1 < len ? base64_chars[(v >> 6) & 63] : '=';
+    ret += '=';
+  }
+  return ret;
+}
+
+static bool base64_decode(duk_context *ctx, std::string const &str) {
+  static auto const table = [] {
+    std::array<int8_t, 256> ret;
+    ret.fill(-1);
+    for (int i = 0; i < 64; i++) ret[(unsigned char)base64_chars[i]] = i;
+    return ret;
+  }();
+  auto len = str.size();
+  if (len % 4) return false;
+  size_t pad = len && str[len - 1] == '=' ? len > 1 && str[len - 2] == '=' ? 2 : 1 : 0;
+  auto out   = (unsigned char *)duk_push_fixed_buffer(ctx, len / 4 * 3 - pad);
+  for (size_t i = 0, o = 0; i < len; i += 4) {
+    uint32_t v = 0;
+    for (size_t j = 0; j < 4; j++) {
+      auto c = table[(unsigned char)str[i + j]];
+      if (i + 4 == len && j >= 4 - pad) {
+        c = 0;
+      } else if (c < 0) {
+        duk_pop(ctx);
+        return false;
+      }
+      v = v << 6 | c;
+    }
+    out[o++] = v >> 16;
+    if (o < len / 4 * 3 - pad) out[o++] = (v >> 8) & 0xFF;
+    if (o < len / 4 * 3 - pad) out[o++] = v & 0xFF;
+  }
+  return true;
+}
+
+// Buffers and typed arrays travel as { "$binary": "<base64>" }, duk_push_json turns that shape back into a plain buffer.
 nlohmann::json duk_get_json(duk_context *ctx, duk_idx_t idx) {
   using namespace nlohmann;
+  if (duk_is_buffer_data(ctx, idx)) {
+    duk_size_t len;
+    auto data = (unsigned char const *)duk_get_buffer_data(ctx, idx, &len);
+    return json::object({ { "$binary", base64_encode(data, len) } });
+  }
   switch (duk_get_type(ctx, idx)) {
   case DUK_TYPE_UNDEFINED:
   case DUK_TYPE_NULL: return nullptr;
@@ -85,6 +146,9 @@ void duk_push_json(duk_context *ctx, nlohmann::json data) {
     duk_push_lstring(ctx, str.c_str(), str.length());
   } break;
   case json::value_t::object: {
+    if (data.size() == 1) {
+      if (auto it = data.find("$binary"); it != data.end() && it->is_string() && base64_decode(ctx, it->get_ref<std::string const &>())) break;
+    }
     duk_push_object(ctx);
     for (auto &[key, value] : data.items()) {
       duk_push_json(ctx, value);
@@ -95,7 +159,7 @@ void duk_push_json(duk_context *ctx, nlohmann::json data) {
     duk_push_array(ctx);
     duk_uarridx_t i = 0;
     for (auto &value : data) {
-      duk_push_json(ctx, data);
+      duk_push_json(ctx, value);
       duk_put_prop_index(ctx, -2, i++);
     }
   } break;
@@ -175,9 +239,14 @@ static inline void lib_common(duk_context *ctx) {
     read(ev.data.fd, &tmp, sizeof tmp);
     duk_get_global_string(ctx, DUK_HIDDEN_SYMBOL("timer"));
     duk_get_prop_index(ctx, -1, ev.data.fd);
-    auto rc = duk_pcall(ctx, 0);
+    duk_int_t rc;
+    {
+      exec_budget budget{ exec_budget::callback };
+      rc = duk_pcall(ctx, 0);
+    }
     if (rc != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
     duk_pop(ctx);
+    duk_run_jobs(ctx);
     timerfd_gettime(ev.data.fd, &spec);
     if (spec.it_interval.tv_nsec == 0 && spec.it_interval.tv_sec == 0) {
       duk_del_prop_index(ctx, -1, ev.data.fd);
@@ -210,6 +279,8 @@ static inline void lib_common(duk_context *ctx) {
       },
       3);
   duk_put_global_string(ctx, "timer");
+  duk_eval_string(ctx, "(function(ms) { return new Promise(function(resolve) { timer(resolve, ms); }); })");
+  duk_put_global_string(ctx, "delay");
   duk_push_c_function(
       ctx,
       +[](duk_context *ctx) -> duk_ret_t {
@@ -677,11 +748,19 @@ static inline void lib_fs(duk_context *ctx) {
           try {
             std::ifstream t(path);
             std::string str((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
-            if (as_string) {
-              duk_push_string(ctx, str.c_str());
+            if (as_string && utf8_validate(str.data(), str.size())) {
+              duk_push_lstring(ctx, str.data(), str.size());
+            } else if (as_string) {
+              // malformed input goes through TextDecoder so it gets U+FFFD replacement like node does
+              duk_get_global_string(ctx, "TextDecoder");
+              duk_new(ctx, 0);
+              duk_push_string(ctx, "decode");
+              memcpy(duk_push_fixed_buffer(ctx, str.size()), str.data(), str.size());
+              duk_call_prop(ctx, -3, 1);
+              duk_remove(ctx, -2);
             } else {
               duk_push_fixed_buffer(ctx, str.size());
-              strncpy((char *)duk_get_buffer(ctx, -1, nullptr), str.data(), str.length());
+              memcpy(duk_get_buffer(ctx, -1, nullptr), str.data(), str.length());
             }
           } catch (fs::filesystem_error &e) {
             duk_generic_error(ctx, "%s", e.what());
@@ -1028,24 +1107,189 @@ static inline void lib_os(duk_context *ctx) {
   duk_put_global_string(ctx, "os");
 }
 
+// Callbacks of a call are kept as an array under its uid, so callShared can attach more of them to a call that is
+// already on the wire; the flight is forgotten before any callback runs, letting callbacks start a fresh one. They run
+// in the scope of the export call that issued the request, so calls they make upstream carry on its deadline.
+static void settle_call(duk_context *ctx, void *self, duk_uarridx_t uid, std::string const &flight, uint64_t origin, duk_idx_t nargs) {
+  call_scope scope{ origin };
+  duk_push_heapptr(ctx, self);
+  duk_insert(ctx, 0);
+  if (!flight.empty()) {
+    duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("flights"));
+    duk_del_prop_lstring(ctx, -1, flight.data(), flight.size());
+    duk_pop(ctx);
+  }
+  duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("callback"));
+  duk_get_prop_index(ctx, -1, uid);
+  duk_del_prop_index(ctx, -2, uid);
+  duk_remove(ctx, -2);
+  duk_insert(ctx, 1);
+  for (duk_uarridx_t i = 0, len = duk_get_length(ctx, 1); i < len; i++) {
+    duk_get_prop_index(ctx, 1, i);
+    duk_dup(ctx, 0);
+    for (duk_idx_t arg = 0; arg < nargs; arg++) duk_dup(ctx, 2 + arg);
+    {
+      exec_budget budget{ exec_budget::callback };
+      if (duk_pcall_method(ctx, nargs) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
+    }
+    duk_pop(ctx);
+  }
+  duk_pop_n(ctx, duk_get_top(ctx));
+  duk_run_jobs(ctx);
+}
+
+// a chunk of a streaming export goes to the onchunk(data, index) given to call, with the rpc object as this
+static void deliver_chunk(duk_context *ctx, void *self, duk_uarridx_t uid, uint64_t origin, nlohmann::json const &data, uint64_t index) {
+  assert(duk_get_top(ctx) == 0);
+  call_scope scope{ origin };
+  duk_push_heapptr(ctx, self);
+  duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("callback"));
+  duk_get_prop_index(ctx, 1, uid);
+  duk_get_prop_string(ctx, 2, "onchunk");
+  if (duk_is_callable(ctx, 3)) {
+    duk_dup(ctx, 0);
+    duk_push_json(ctx, data);
+    duk_push_number(ctx, (duk_double_t)index);
+    exec_budget budget{ exec_budget::callback };
+    if (duk_pcall_method(ctx, 2) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
+  }
+  duk_pop_n(ctx, duk_get_top(ctx));
+  duk_run_jobs(ctx);
+}
+
+// call(name, params[, callback[, onchunk]]): a ysrv export answering $pending settles the call once its reply arrives
+static duk_ret_t rpc_call(duk_context *ctx, bool shared) {
+  auto name = duk_require_string(ctx, 0);
+  duk_require_object(ctx, 1);
+  // chunks could only go to the caller that started a call, so callShared takes no onchunk
+  duk_set_top(ctx, 4);
+  if (!duk_is_undefined(ctx, 3)) duk_require_function(ctx, 3);
+  // without a callback the call returns a promise, settled through the callback of a deferred
+  auto deferred = duk_is_undefined(ctx, 2);
+  if (deferred) {
+    duk_push_deferred(ctx);
+    duk_get_prop_string(ctx, -1, "callback");
+    duk_replace(ctx, 2);
+  } else {
+    duk_require_function(ctx, 2);
+  }
+  auto data = duk_get_json(ctx, 1);
+  // identical params dump identically, the key joins name and params with a character neither can contain raw
+  std::string flight;
+  if (shared) flight = std::string{ name } + '\n' + data.dump();
+  // an export call that has run out of time makes no more calls; the time it has left only goes along to upstreams
+  // created with { deadlines: true }, other servers would take $timeoutMs for a param of their own
+  auto origin    = call_scope::current();
+  auto remaining = call_scope::remaining_ms();
+  if (remaining == 0) return duk_error(ctx, DUK_ERR_RANGE_ERROR, "deadline exceeded");
+  duk_push_this(ctx);
+  auto self = duk_get_heapptr(ctx, -1);
+  auto top  = duk_get_top_index(ctx);
+  duk_get_prop_string(ctx, top, DUK_HIDDEN_SYMBOL("deadlines"));
+  if (duk_get_boolean(ctx, -1) && remaining > 0 && data.is_object() && !data.contains("$timeoutMs")) data["$timeoutMs"] = remaining;
+  duk_pop(ctx);
+  duk_get_prop_string(ctx, top, DUK_HIDDEN_SYMBOL("callback"));
+  if (shared) {
+    duk_get_prop_string(ctx, top, DUK_HIDDEN_SYMBOL("flights"));
+    if (duk_get_prop_lstring(ctx, -1, flight.data(), flight.size())) {
+      duk_get_prop_index(ctx, top + 1, duk_get_uint(ctx, -1));
+      duk_dup(ctx, 2);
+      duk_put_prop_index(ctx, -2, duk_get_length(ctx, -2));
+      if (deferred) {
+        duk_get_prop_string(ctx, 4, "promise");
+        return 1;
+      }
+      return 0;
+    }
+    duk_pop_2(ctx);
+  }
+  auto uid = duk_get_unique_id(ctx, -1);
+  duk_push_array(ctx);
+  duk_dup(ctx, 2);
+  duk_put_prop_index(ctx, -2, 0);
+  if (!duk_is_undefined(ctx, 3)) {
+    duk_dup(ctx, 3);
+    duk_put_prop_string(ctx, -2, "onchunk");
+  }
+  duk_put_prop_index(ctx, -2, uid);
+  if (shared) {
+    duk_get_prop_string(ctx, top, DUK_HIDDEN_SYMBOL("flights"));
+    duk_push_uint(ctx, uid);
+    duk_put_prop_lstring(ctx, -2, flight.data(), flight.size());
+    duk_pop(ctx);
+  }
+  duk_get_prop_string(ctx, top, DUK_HIDDEN_SYMBOL("obj"));
+  auto &it = *(rpcws::RPC::Client *)duk_get_pointer(ctx, -1);
+  duk_get_prop_string(ctx, top, DUK_HIDDEN_SYMBOL("pending"));
+  auto pending = (pending_replies *)duk_get_pointer(ctx, -1);
+  it.call(name, data)
+      .then([=](auto ret) {
+        assert(duk_get_top(ctx) == 0);
+        auto onchunk = [=](nlohmann::json const &data, uint64_t index) { deliver_chunk(ctx, self, uid, origin, data, index); };
+        auto settle  = [=](nlohmann::json const &reply) {
+          assert(duk_get_top(ctx) == 0);
+          if (auto error = reply.find("error"); error != reply.end()) {
+            auto message = error->is_string() ? error->get<std::string>() : error->dump();
+            duk_push_error_object(ctx, DUK_ERR_ERROR, "%s", message.c_str());
+            return settle_call(ctx, self, uid, flight, origin, 1);
+          }
+          duk_push_undefined(ctx);
+          duk_push_json(ctx, reply.value("result", nlohmann::json{}));
+          settle_call(ctx, self, uid, flight, origin, 2);
+        };
+        if (pending->follow(ret, onchunk, settle)) return;
+        duk_push_undefined(ctx);
+        duk_push_json(ctx, ret);
+        settle_call(ctx, self, uid, flight, origin, 2);
+      })
+      .fail([=](auto e) {
+        assert(duk_get_top(ctx) == 0);
+        try {
+          std::rethrow_exception(e);
+        } catch (std::exception &e) { duk_push_error_object(ctx, DUK_ERR_ERROR, "%s", e.what()); }
+        settle_call(ctx, self, uid, flight, origin, 1);
+      });
+  if (deferred) {
+    duk_get_prop_string(ctx, 4, "promise");
+    return 1;
+  }
+  return 0;
+}
+
 static inline void lib_rpc(duk_context *ctx) {
   duk_push_c_function(
       ctx,
       +[](duk_context *ctx) -> duk_ret_t {
         if (!duk_is_constructor_call(ctx)) return DUK_RET_TYPE_ERROR;
-        duk_push_this(ctx);
         auto addr = duk_require_string(ctx, 0);
         duk_require_function(ctx, 1);
+        // new rpc(addr, onerror, { deadlines }): deadlines passes the calling export's remaining time as $timeoutMs,
+        // for upstreams that are ysrv themselves
+        auto deadlines = false;
+        if (!duk_is_undefined(ctx, 2)) {
+          duk_require_object(ctx, 2);
+          duk_get_prop_string(ctx, 2, "deadlines");
+          deadlines = duk_to_boolean(ctx, -1);
+        }
+        duk_set_top(ctx, 2);
+        duk_push_this(ctx);
         try {
-          auto io = std::make_unique<rpcws::client_wsio>(addr, holder<std::shared_ptr<epoll>>());
-          duk_push_pointer(ctx, new rpcws::RPC::Client{ std::move(io) });
+          auto io     = std::make_unique<rpcws::client_wsio>(addr, holder<std::shared_ptr<epoll>>());
+          auto client = new rpcws::RPC::Client{ std::move(io) };
+          duk_push_pointer(ctx, client);
           duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("obj"));
+          duk_push_pointer(ctx, new pending_replies{ *client });
+          duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("pending"));
           duk_push_bare_object(ctx);
           duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("event"));
           duk_push_bare_object(ctx);
           duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("callback"));
+          duk_push_bare_object(ctx);
+          duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("flights"));
           duk_push_false(ctx);
           duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("started"));
+          duk_push_boolean(ctx, deadlines);
+          duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("deadlines"));
           duk_dup(ctx, 1);
           duk_put_prop_string(ctx, 2, DUK_HIDDEN_SYMBOL("error"));
           duk_push_c_function(
@@ -1053,6 +1297,8 @@ static inline void lib_rpc(duk_context *ctx) {
               +[](duk_context *ctx) -> duk_ret_t {
                 duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("obj"));
                 delete (rpcws::RPC::Client *)duk_get_pointer(ctx, -1);
+                duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("pending"));
+                delete (pending_replies *)duk_get_pointer(ctx, -1);
                 return 0;
               },
               1);
@@ -1063,7 +1309,7 @@ static inline void lib_rpc(duk_context *ctx) {
         }
         return 0;
       },
-      2);
+      3);
   duk_push_object(ctx);
   duk_function_list_entry funcs[] = {
     { "start",
@@ -1090,8 +1336,12 @@ static inline void lib_rpc(duk_context *ctx) {
               duk_push_heapptr(ctx, self);
               duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("connected"));
               duk_dup(ctx, 0);
-              if (duk_pcall_method(ctx, 0) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
+              {
+                exec_budget budget{ exec_budget::callback };
+                if (duk_pcall_method(ctx, 0) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
+              }
               duk_pop_n(ctx, duk_get_top(ctx));
+              duk_run_jobs(ctx);
             })
             .fail([=](std::exception_ptr e) {
               assert(duk_get_top(ctx) == 0);
@@ -1101,8 +1351,12 @@ static inline void lib_rpc(duk_context *ctx) {
               try {
                 std::rethrow_exception(e);
               } catch (std::exception &e) { duk_generic_error(ctx, "%s", e.what()); }
-              if (duk_pcall_method(ctx, 1) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
+              {
+                exec_budget budget{ exec_budget::callback };
+                if (duk_pcall_method(ctx, 1) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
+              }
               duk_pop_n(ctx, duk_get_top(ctx));
+              duk_run_jobs(ctx);
             });
         return 0;
       },
@@ -1116,52 +1370,8 @@ static inline void lib_rpc(duk_context *ctx) {
         return 0;
       },
       0 },
-    { "call",
-      +[](duk_context *ctx) -> duk_ret_t {
-        auto name = duk_require_string(ctx, 0);
-        duk_require_object(ctx, 1);
-        duk_require_function(ctx, 2);
-        duk_push_this(ctx);
-        auto self = duk_get_heapptr(ctx, -1);
-        duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("obj"));
-        auto &it = *(rpcws::RPC::Client *)duk_get_pointer(ctx, -1);
-        duk_pop(ctx);
-        duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("callback"));
-        auto uid = duk_get_unique_id(ctx, -1);
-        duk_dup(ctx, 2);
-        duk_put_prop_index(ctx, -2, uid);
-        duk_pop(ctx);
-        duk_pop(ctx);
-        auto data = duk_get_json(ctx, 1);
-        it.call(name, data)
-            .then([=](auto ret) {
-              assert(duk_get_top(ctx) == 0);
-              duk_push_heapptr(ctx, self);
-              duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("callback"));
-              duk_get_prop_index(ctx, 1, uid);
-              duk_del_prop_index(ctx, 1, uid);
-              duk_dup(ctx, 0);
-              duk_push_undefined(ctx);
-              duk_push_json(ctx, ret);
-              if (duk_pcall_method(ctx, 2) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
-              duk_pop_n(ctx, duk_get_top(ctx));
-            })
-            .fail([=](auto e) {
-              assert(duk_get_top(ctx) == 0);
-              duk_push_heapptr(ctx, self);
-              duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("callback"));
-              duk_get_prop_index(ctx, 1, uid);
-              duk_del_prop_index(ctx, 1, uid);
-              duk_dup(ctx, 0);
-              try {
-                std::rethrow_exception(e);
-              } catch (std::exception &e) { duk_generic_error(ctx, "%s", e.what()); }
-              if (duk_pcall_method(ctx, 1) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
-              duk_pop_n(ctx, duk_get_top(ctx));
-            });
-        return 0;
-      },
-      3 },
+    { "call", +[](duk_context *ctx) -> duk_ret_t { return rpc_call(ctx, false); }, 4 },
+    { "callShared", +[](duk_context *ctx) -> duk_ret_t { return rpc_call(ctx, true); }, 3 },
     { "on",
       +[](duk_context *ctx) -> duk_ret_t {
         auto name = duk_require_string(ctx, 0);
@@ -1188,8 +1398,12 @@ static inline void lib_rpc(duk_context *ctx) {
             duk_dup(ctx, 0);
             duk_push_string(ctx, xname.c_str());
             duk_push_json(ctx, data);
-            if (duk_pcall_method(ctx, 2) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
+            {
+              exec_budget budget{ exec_budget::callback };
+              if (duk_pcall_method(ctx, 2) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
+            }
             duk_pop_n(ctx, duk_get_top(ctx));
+            duk_run_jobs(ctx);
           });
         return 0;
       },
@@ -1214,6 +1428,73 @@ static inline void lib_rpc(duk_context *ctx) {
         return 0;
       },
       2 },
+    { "forward",
+      +[](duk_context *ctx) -> duk_ret_t {
+        auto name       = duk_require_string(ctx, 0);
+        auto local      = std::string{ duk_require_string(ctx, 1) };
+        void *transform = nullptr;
+        if (!duk_is_undefined(ctx, 2)) {
+          duk_require_object(ctx, 2);
+          duk_get_prop_string(ctx, 2, "transform");
+          if (!duk_is_undefined(ctx, -1)) {
+            duk_require_function(ctx, -1);
+            transform = duk_get_heapptr(ctx, -1);
+          } else {
+            duk_push_true(ctx);
+            duk_replace(ctx, -2);
+          }
+        } else {
+          duk_push_true(ctx);
+        }
+        auto handler = duk_get_top_index(ctx);
+        try {
+          event_declare(local, nullptr);
+        } catch (std::exception &e) {
+          duk_generic_error(ctx, "%s", e.what());
+          return duk_throw(ctx);
+        }
+        duk_push_this(ctx);
+        auto self = duk_get_heapptr(ctx, -1);
+        duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("obj"));
+        auto &it = *(rpcws::RPC::Client *)duk_get_pointer(ctx, -1);
+        duk_pop(ctx);
+        duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("event"));
+        duk_dup(ctx, 0);
+        if (duk_has_prop(ctx, -2)) {
+          duk_generic_error(ctx, "key '%s' exists", name);
+          return duk_throw(ctx);
+        }
+        // the transform is kept alive through the same table that on() uses, off() drops it
+        duk_dup(ctx, 0);
+        duk_dup(ctx, handler);
+        duk_put_prop(ctx, -3);
+        if (!transform) {
+          it.on(name, [local](auto data) { event_emit(local, std::move(data)); });
+          return 0;
+        }
+        it.on(name, [=, xname = std::string{ name }](auto data) {
+          assert(duk_get_top(ctx) == 0);
+          duk_push_heapptr(ctx, self);
+          duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("event"));
+          duk_get_prop_string(ctx, 1, xname.c_str());
+          duk_dup(ctx, 0);
+          duk_push_json(ctx, data);
+          duk_int_t rc;
+          {
+            exec_budget budget{ exec_budget::callback };
+            rc = duk_pcall_method(ctx, 1);
+          }
+          if (rc != DUK_EXEC_SUCCESS) {
+            std::cerr << duk_safe_to_string(ctx, -1) << std::endl;
+          } else if (!duk_is_undefined(ctx, -1)) {
+            event_emit(local, duk_get_json(ctx, -1));
+          }
+          duk_pop_n(ctx, duk_get_top(ctx));
+          duk_run_jobs(ctx);
+        });
+        return 0;
+      },
+      3 },
     { nullptr, nullptr, 0 },
   };
   duk_put_function_list(ctx, -1, funcs);
@@ -1222,6 +1503,14 @@ static inline void lib_rpc(duk_context *ctx) {
 }
 
 void init_duk_stdlib(duk_context *ctx) {
+  init_duk_json(ctx);
+  assert(duk_get_top(ctx) == 0);
+  assert(duk_get_top(ctx) == 0);
+  init_duk_promise(ctx);
+  init_duk_budget(ctx);
+  init_duk_compile(ctx);
+  init_duk_exports(ctx);
+  assert(duk_get_top(ctx) == 0);
   lib_common(ctx);
   assert(duk_get_top(ctx) == 0);
   lib_fs(ctx);
@@ -1,8 +1,77 @@
 #pragma once
+#include <chrono>
 #include <duktape.h>
 #include <epoll.hpp>
 #include <json.hpp>
+#include <type_traits>
 
 nlohmann::json duk_get_json(duk_context *ctx, duk_idx_t idx);
 void duk_push_json(duk_context *ctx, nlohmann::json data);
-void init_duk_stdlib(duk_context *_ctx);
\ No newline at end of file
+bool utf8_validate(char const *data, size_t len);
+void init_duk_json(duk_context *ctx);
+void duk_queue_job(duk_context *ctx, duk_idx_t idx);
+void duk_run_jobs(duk_context *ctx);
+void duk_push_deferred(duk_context *ctx);
+void init_duk_promise(duk_context *ctx);
+void init_duk_budget(duk_context *ctx);
+// pushes a function calling the one at idx with the same this and arguments, for options to be set on instead of the
+// caller's function; wrapping a wrapper carries its options over
+void duk_push_wrapper(duk_context *ctx, duk_idx_t idx);
+void init_duk_compile(duk_context *ctx);
+void init_duk_stdlib(duk_context *_ctx);
+
+// caps how long JS may run until the guard goes out of scope, in ms (0 keeps the outer limit); nested guards only shorten it
+class exec_budget {
+  std::chrono::steady_clock::time_point saved;
+
+public:
+  static unsigned const call, callback;
+  // the budget(ms, fn) override stored on a function, or fallback
+  static unsigned of(duk_context *ctx, duk_idx_t idx, unsigned fallback);
+
+  explicit exec_budget(unsigned ms);
+  exec_budget(exec_budget const &) = delete;
+  ~exec_budget();
+};
+
+// marks the export call whose code is running, rpc.call forwards the time it has left upstream as $timeoutMs
+class call_scope {
+  uint64_t saved;
+
+public:
+  explicit call_scope(uint64_t id);
+  call_scope(call_scope const &) = delete;
+  ~call_scope();
+  static uint64_t current();
+  // ms before the current call's deadline, 0 once it is cancelled, -1 without a deadline
+  static double remaining_ms();
+};
+
+void event_declare(std::string const &name, nlohmann::json const &options);
+void event_emit(std::string const &name, nlohmann::json data);
+// forgets a declared event and its journal once nothing will be emitted on it, after giving clients time to resume it
+void event_retire(std::string const &name);
+void init_events();
+
+nlohmann::json duk_call_export(duk_context *ctx, nlohmann::json data);
+// stores the function at idx under name, true when the name is new; export_slot stays valid for the process lifetime
+struct export_entry;
+bool export_define(duk_context *ctx, std::string const &name, duk_idx_t idx);
+export_entry &export_slot(std::string const &name);
+// calls the export with self as this after admission control for the connection identified by client, or answers
+// from its response cache when it was wrapped in cached()
+nlohmann::json export_dispatch(duk_context *ctx, export_entry &entry, void *self, void const *client, nlohmann::json data);
+// wsrpc hands handlers either the connection itself or a raw or smart pointer to it, all of which map to its address
+template <typename T> void const *client_identity(T const &client) {
+  if constexpr (std::is_pointer_v<T>)
+    return client;
+  else if constexpr (requires { client.get(); })
+    return client.get();
+  else
+    return &client;
+}
+void init_duk_exports(duk_context *ctx);
+void init_exports();
+
+enum class utf8_kernel { scalar, sse2, avx2 };
+bool utf8_validate(char const *data, size_t len, utf8_kernel kernel);
\ No newline at end of file
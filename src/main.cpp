@@ -18,17 +18,20 @@ int main() {
     auto ep = std::make_shared<epoll>();
     static RPC endpoint{ std::make_unique<server_wsio>(YSRV_ENDPOINT, ep) };
     holder{ ep };
+    holder{ endpoint };
     holder{ *ctx };
     duk_int_t rc;
     static void *registry;
 
     init_duk_stdlib(ctx);
+    init_events();
+    init_exports();
 
     rc = duk_peval_string(ctx, R"((function(reg) {
       var ret = new Proxy({}, {
         set: function(tgt, prop, value) {
           tgt[prop] = value;
-          reg(prop);
+          reg(prop, value);
           return value;
         },
         deleteProperty: function(tgt, prop) {
@@ -47,31 +50,27 @@ int main() {
     duk_push_c_function(
         ctx,
         +[](duk_context *) -> duk_ret_t {
-          std::string name = duk_get_string(ctx, -1);
-          endpoint.reg(name, [=](auto, json data) -> json {
-            duk_push_heapptr(ctx, registry);
-            duk_push_string(ctx, name.c_str());
-            duk_push_json(ctx, data);
-            auto rc = duk_pcall_prop(ctx, -3, 1);
-            if (rc == DUK_EXEC_SUCCESS) {
-              auto ret = duk_get_json(ctx, -1);
-              duk_pop(ctx);
-              return ret;
-            } else {
-              throw std::runtime_error(duk_to_string(ctx, -1));
-            }
+          std::string name = duk_get_string(ctx, 0);
+          if (!export_define(ctx, name, 1)) return 0;
+          endpoint.reg(name, [&entry = export_slot(name)](auto const &client, json data) -> json {
+            return export_dispatch(ctx, entry, registry, client_identity(client), std::move(data));
           });
           return 0;
         },
-        1);
+        2);
     duk_call(ctx, 1);
     registry = duk_get_heapptr(ctx, -1);
     duk_pop(ctx);
     duk_push_c_function(
         ctx,
         +[](duk_context *) -> duk_ret_t {
-          auto a1 = duk_require_string(ctx, -1);
-          endpoint.event(a1);
+          auto a1 = duk_require_string(ctx, 0);
+          try {
+            event_declare(a1, duk_is_undefined(ctx, 1) ? json{} : duk_get_json(ctx, 1));
+          } catch (std::exception &e) {
+            duk_generic_error(ctx, "%s", e.what());
+            return duk_throw(ctx);
+          }
           duk_push_c_function(
               ctx,
               +[](duk_context *) -> duk_ret_t {
@@ -79,17 +78,17 @@ int main() {
                 auto data = duk_get_json(ctx, -1);
                 duk_push_this(ctx);
                 auto ev = duk_get_string(ctx, -1);
-                endpoint.emit(ev, data);
+                event_emit(ev, std::move(data));
                 duk_pop(ctx);
                 return 1;
               },
               1);
           duk_push_string(ctx, "bind");
-          duk_dup(ctx, -3);
+          duk_dup(ctx, 0);
           duk_call_prop(ctx, -3, 1);
           return 1;
         },
-        1);
+        2);
     duk_put_global_string(ctx, "event");
     duk_push_bare_object(ctx);
     duk_put_global_string(ctx, "services");
@@ -98,6 +97,7 @@ int main() {
       fstat(fd, &stat);
       auto target = mmap(nullptr, stat.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
       duk_peval_lstring_noresult(ctx, (char const *)target, stat.st_size);
+      duk_run_jobs(ctx);
       munmap(target, stat.st_size);
     }
     endpoint.start();
@@ -0,0 +1,114 @@
+#pragma once
+#include <rpcws.hpp>
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A ysrv export that completes later answers { $pending: id, $reply: topic } right away and sends { id, result } or
+// { id, error } on that topic when it is done; a streaming export adds $stream, where chunks arrive as
+// { id, index, data } ahead of a final reply that counts them. pending_replies follows those topics for one connection:
+// it subscribes, picks up whatever went out before the subscription through ysrv.resume, hands chunks over in order,
+// acknowledges them so the stream keeps going, and settles once the reply and every chunk it counts are in.
+class pending_replies {
+public:
+  using json     = nlohmann::json;
+  using chunk_fn = std::function<void(json const &data, uint64_t index)>;
+  // gets the final { id, result } or { id, error }
+  using settle_fn = std::function<void(json const &reply)>;
+
+  explicit pending_replies(rpcws::RPC::Client &client)
+      : client(client) {}
+
+  // false when reply is the answer itself, otherwise settle runs once the call completes; a second call of this
+  // connection joined to the same single flight shares the topic and only sees the chunks that arrive after it
+  bool follow(json const &reply, chunk_fn onchunk, settle_fn settle) {
+    if (!reply.is_object() || !reply.contains("$pending") || !reply.contains("$reply")) return false;
+    // wsrpc may be walking its handlers while one of them settles a call, so its topics are dropped here instead
+    for (auto &name : retired) client.off(name);
+    retired.clear();
+    auto &it = calls[reply["$reply"].get<std::string>()];
+    if (it) {
+      it->waiters.push_back({ std::move(onchunk), std::move(settle) });
+      return true;
+    }
+    it         = std::make_shared<call>();
+    it->id     = reply["$pending"].get<uint64_t>();
+    it->reply  = reply["$reply"].get<std::string>();
+    it->stream = reply.value("$stream", "");
+    it->waiters.push_back({ std::move(onchunk), std::move(settle) });
+    client.on(it->reply, [this, c = it](json msg) { take_reply(*c, msg["data"]); });
+    if (!it->stream.empty()) {
+      client.on(it->stream, [this, c = it](json msg) { take_chunk(*c, msg["data"]); });
+      client.call("ysrv.resume", { { "event", it->stream }, { "since", 0 } })
+          .then([this, c = it](json res) {
+            for (auto &event : res["events"]) take_chunk(*c, event["data"]);
+          })
+          .fail([](std::exception_ptr) {});
+    }
+    // the stream is resumed first, so a reply found here usually has its chunks in already
+    client.call("ysrv.resume", { { "event", it->reply }, { "since", 0 } })
+        .then([this, c = it](json res) {
+          for (auto &event : res["events"]) take_reply(*c, event["data"]);
+        })
+        .fail([this, c = it](std::exception_ptr ex) {
+          try {
+            std::rethrow_exception(ex);
+          } catch (std::exception &e) { take_reply(*c, { { "id", c->id }, { "error", std::string{ "reply lost: " } + e.what() } }); }
+        });
+    return true;
+  }
+
+private:
+  struct waiter {
+    chunk_fn onchunk;
+    settle_fn settle;
+  };
+  struct call {
+    uint64_t id;
+    std::string reply, stream;
+    std::vector<waiter> waiters;
+    uint64_t next = 0;
+    // chunks that came in ahead of a missing one
+    std::map<uint64_t, json> early;
+    json result;
+    bool done = false;
+  };
+
+  rpcws::RPC::Client &client;
+  std::map<std::string, std::shared_ptr<call>> calls;
+  std::vector<std::string> retired;
+
+  void take_chunk(call &c, json const &chunk) {
+    if (c.done || !chunk.is_object() || chunk.value("id", (uint64_t)0) != c.id || !chunk.contains("index")) return;
+    auto index = chunk["index"].get<uint64_t>();
+    if (index < c.next) return;
+    c.early.emplace(index, chunk.value("data", json{}));
+    auto from = c.next;
+    // a callback may join another call to this one, which grows waiters
+    for (auto it = c.early.begin(); it != c.early.end() && it->first == c.next; it = c.early.erase(it), c.next++)
+      for (size_t i = 0; i < c.waiters.size(); i++) c.waiters[i].onchunk(it->second, c.next);
+    if (c.next > from) client.call("ysrv.ack", { { "id", c.id }, { "index", c.next - 1 } }).fail([](std::exception_ptr) {});
+    try_settle(c);
+  }
+
+  void take_reply(call &c, json const &reply) {
+    if (c.done || !reply.is_object() || reply.value("id", (uint64_t)0) != c.id) return;
+    c.result = reply;
+    try_settle(c);
+  }
+
+  void try_settle(call &c) {
+    if (c.done || c.result.is_null()) return;
+    if (!c.result.contains("error") && c.result.contains("chunks") && c.next < c.result["chunks"].get<uint64_t>()) return;
+    c.done = true;
+    retired.push_back(c.reply);
+    if (!c.stream.empty()) retired.push_back(c.stream);
+    calls.erase(c.reply);
+    for (auto &w : c.waiters) w.settle(c.result);
+  }
+};
@@ -0,0 +1,379 @@
+#include "lib.h"
+#include "utils.h"
+
+#include <chrono>
+#include <deque>
+#include <duktape.h>
+#include <iostream>
+#include <sys/eventfd.h>
+
+// The state machine is plain ES5 evaluated once at startup, with its bookkeeping kept under hidden symbols. Every
+// reaction goes through the native job queue below, which is drained each time control is about to return to epoll.
+static char const promise_source[] = R"((function(enqueue, STATE, VALUE, REACTIONS, HANDLED, DEFERRED) {
+  var PENDING = 0, FULFILLED = 1, REJECTED = 2;
+
+  function Promise(executor) {
+    if (!(this instanceof Promise)) throw new TypeError('Promise constructor requires new');
+    if (typeof executor !== 'function') throw new TypeError('Promise resolver is not a function');
+    this[STATE] = PENDING;
+    this[REACTIONS] = [];
+    var fns = resolvers(this);
+    try {
+      executor(fns.resolve, fns.reject);
+    } catch (e) {
+      fns.reject(e);
+    }
+  }
+
+  function resolvers(promise) {
+    var done = false;
+    return {
+      resolve: function(value) {
+        if (done) return;
+        done = true;
+        resolve(promise, value);
+      },
+      reject: function(reason) {
+        if (done) return;
+        done = true;
+        settle(promise, REJECTED, reason);
+      }
+    };
+  }
+
+  function resolve(promise, value) {
+    if (value === promise) return settle(promise, REJECTED, new TypeError('Chaining cycle detected for promise'));
+    if (value !== null && (typeof value === 'object' || typeof value === 'function')) {
+      var then;
+      try {
+        then = value.then;
+      } catch (e) {
+        return settle(promise, REJECTED, e);
+      }
+      if (typeof then === 'function') {
+        var fns = resolvers(promise);
+        enqueue(function() {
+          try {
+            then.call(value, fns.resolve, fns.reject);
+          } catch (e) {
+            fns.reject(e);
+          }
+        });
+        return;
+      }
+    }
+    settle(promise, FULFILLED, value);
+  }
+
+  function settle(promise, state, value) {
+    var reactions = promise[REACTIONS];
+    promise[STATE] = state;
+    promise[VALUE] = value;
+    promise[REACTIONS] = undefined;
+    for (var i = 0; i < reactions.length; i++) schedule(promise, reactions[i]);
+    if (state === REJECTED && !promise[HANDLED]) {
+      enqueue(function() {
+        if (!promise[HANDLED]) throw 'Unhandled promise rejection: ' + String(value);
+      });
+    }
+  }
+
+  function schedule(promise, reaction) {
+    enqueue(function() {
+      var fulfilled = promise[STATE] === FULFILLED;
+      var handler = fulfilled ? reaction.onFulfilled : reaction.onRejected;
+      if (typeof handler !== 'function') return (fulfilled ? reaction.resolve : reaction.reject)(promise[VALUE]);
+      var result;
+      try {
+        result = handler(promise[VALUE]);
+      } catch (e) {
+        return reaction.reject(e);
+      }
+      reaction.resolve(result);
+    });
+  }
+
+  Promise.prototype.then = function(onFulfilled, onRejected) {
+    var reaction = { onFulfilled: onFulfilled, onRejected: onRejected };
+    var next = new Promise(function(resolve, reject) {
+      reaction.resolve = resolve;
+      reaction.reject = reject;
+    });
+    this[HANDLED] = true;
+    if (this[STATE] === PENDING)
+      this[REACTIONS].push(reaction);
+    else
+      schedule(this, reaction);
+    return next;
+  };
+
+  Promise.prototype['catch'] = function(onRejected) {
+    return this.then(undefined, onRejected);
+  };
+
+  Promise.prototype['finally'] = function(fn) {
+    return this.then(function(value) {
+      return Promise.resolve(fn()).then(function() { return value; });
+    }, function(reason) {
+      return Promise.resolve(fn()).then(function() { throw reason; });
+    });
+  };
+
+  Promise.resolve = function(value) {
+    if (value instanceof Promise) return value;
+    return new Promise(function(resolve) { resolve(value); });
+  };
+
+  Promise.reject = function(reason) {
+    return new Promise(function(resolve, reject) { reject(reason); });
+  };
+
+  Promise.all = function(list) {
+    return new Promise(function(resolve, reject) {
+      var results = [], remaining = list.length;
+      if (!remaining) return resolve(results);
+      list.forEach(function(item, i) {
+        Promise.resolve(item).then(function(value) {
+          results[i] = value;
+          if (--remaining === 0) resolve(results);
+        }, reject);
+      });
+    });
+  };
+
+  Promise.allSettled = function(list) {
+    return Promise.all(list.map(function(item) {
+      return Promise.resolve(item).then(function(value) {
+        return { status: 'fulfilled', value: value };
+      }, function(reason) {
+        return { status: 'rejected', reason: reason };
+      });
+    }));
+  };
+
+  Promise.race = function(list) {
+    return new Promise(function(resolve, reject) {
+      list.forEach(function(item) { Promise.resolve(item).then(resolve, reject); });
+    });
+  };
+
+  // node style callback for the native APIs that take one, settling the returned promise
+  Promise[DEFERRED] = function() {
+    var deferred = {};
+    deferred.promise = new Promise(function(resolve, reject) {
+      deferred.callback = function(err, value) {
+        if (err != null)
+          reject(err);
+        else
+          resolve(value);
+      };
+    });
+    return deferred;
+  };
+
+  return Promise;
+}))";
+
+static std::deque<duk_uarridx_t> jobs;
+static duk_uarridx_t last_job;
+static bool draining;
+// bumped every time JS ran for some reactor event, an idle round only starts after a wakeup in which it stayed put
+static uint64_t activity;
+
+void duk_queue_job(duk_context *ctx, duk_idx_t idx) {
+  idx = duk_normalize_index(ctx, idx);
+  duk_get_global_string(ctx, DUK_HIDDEN_SYMBOL("jobs"));
+  duk_dup(ctx, idx);
+  duk_put_prop_index(ctx, -2, ++last_job);
+  duk_pop(ctx);
+  jobs.push_back(last_job);
+}
+
+void duk_run_jobs(duk_context *ctx) {
+  activity++;
+  if (jobs.empty() || draining) return;
+  draining = true;
+  duk_get_global_string(ctx, DUK_HIDDEN_SYMBOL("jobs"));
+  while (!jobs.empty()) {
+    auto id = jobs.front();
+    jobs.pop_front();
+    duk_get_prop_index(ctx, -1, id);
+    duk_del_prop_index(ctx, -2, id);
+    exec_budget budget{ exec_budget::callback };
+    if (duk_pcall(ctx, 0) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
+    duk_pop(ctx);
+  }
+  duk_pop(ctx);
+  draining = false;
+}
+
+// setImmediate and requestIdleCallback share one eventfd that is registered once and only written when the first
+// callback of a round gets queued, instead of a timerfd per callback
+constexpr auto idle_budget = std::chrono::milliseconds(50);
+
+struct idle_callback {
+  duk_uarridx_t id;
+  std::chrono::steady_clock::time_point timeout;
+};
+
+static std::deque<duk_uarridx_t> immediates;
+static std::deque<idle_callback> idle_callbacks;
+static duk_uarridx_t last_deferred;
+static unix_file wakeup;
+static bool woken;
+static uint64_t quiet_mark;
+
+static void wake() {
+  if (woken) return;
+  uint64_t one = 1;
+  write(wakeup, &one, sizeof one);
+  woken = true;
+}
+
+static bool run_deferred(duk_context *ctx, char const *table, duk_uarridx_t id, duk_idx_t nargs) {
+  duk_get_global_string(ctx, table);
+  if (!duk_get_prop_index(ctx, -1, id)) {
+    duk_pop_n(ctx, 2 + nargs);
+    return false;
+  }
+  duk_del_prop_index(ctx, -2, id);
+  duk_remove(ctx, -2);
+  duk_insert(ctx, -1 - nargs);
+  {
+    exec_budget budget{ exec_budget::callback };
+    if (duk_pcall(ctx, nargs) != DUK_EXEC_SUCCESS) { std::cerr << duk_safe_to_string(ctx, -1) << std::endl; }
+  }
+  duk_pop(ctx);
+  duk_run_jobs(ctx);
+  return true;
+}
+
+static void push_idle_deadline(duk_context *ctx, std::chrono::steady_clock::time_point end, bool timed_out) {
+  duk_push_object(ctx);
+  duk_push_boolean(ctx, timed_out);
+  duk_put_prop_string(ctx, -2, "didTimeout");
+  duk_push_c_function(
+      ctx,
+      +[](duk_context *ctx) -> duk_ret_t {
+        duk_push_current_function(ctx);
+        duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("end"));
+        auto left = duk_get_number(ctx, -1) - std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        duk_push_number(ctx, left > 0 ? left : 0);
+        return 1;
+      },
+      0);
+  duk_push_number(ctx, std::chrono::duration<double, std::milli>(end.time_since_epoch()).count());
+  duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("end"));
+  duk_put_prop_string(ctx, -2, "timeRemaining");
+}
+
+static void on_wakeup(duk_context *ctx) {
+  uint64_t tmp;
+  read(wakeup, &tmp, sizeof tmp);
+  woken     = false;
+  auto idle = activity == quiet_mark;
+  // callbacks queued while this round runs wait for the next one, same as node
+  for (auto count = immediates.size(); count; count--) {
+    auto id = immediates.front();
+    immediates.pop_front();
+    run_deferred(ctx, DUK_HIDDEN_SYMBOL("immediates"), id, 0);
+  }
+  auto now = std::chrono::steady_clock::now(), end = now + idle_budget;
+  for (auto count = idle_callbacks.size(); count && (idle ? std::chrono::steady_clock::now() < end : true); count--) {
+    auto cb = idle_callbacks.front();
+    idle_callbacks.pop_front();
+    auto timed_out = cb.timeout != std::chrono::steady_clock::time_point{} && cb.timeout <= now;
+    if (!idle && !timed_out) {
+      idle_callbacks.push_back(cb);
+      continue;
+    }
+    push_idle_deadline(ctx, idle ? end : now, timed_out);
+    run_deferred(ctx, DUK_HIDDEN_SYMBOL("idle"), cb.id, 1);
+  }
+  if (!immediates.empty() || !idle_callbacks.empty()) wake();
+  quiet_mark = activity;
+}
+
+static duk_ret_t clear_deferred(duk_context *ctx, char const *table) {
+  auto id = duk_require_uint(ctx, 0);
+  duk_get_global_string(ctx, table);
+  duk_del_prop_index(ctx, -1, id);
+  return 0;
+}
+
+static duk_uarridx_t store_deferred(duk_context *ctx, char const *table) {
+  duk_require_function(ctx, 0);
+  duk_get_global_string(ctx, table);
+  duk_dup(ctx, 0);
+  duk_put_prop_index(ctx, -2, ++last_deferred);
+  wake();
+  return last_deferred;
+}
+
+void duk_push_deferred(duk_context *ctx) {
+  duk_get_global_string(ctx, "Promise");
+  duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("deferred"));
+  duk_swap_top(ctx, -2);
+  duk_call_method(ctx, 0);
+}
+
+void init_duk_promise(duk_context *ctx) {
+  duk_push_bare_object(ctx);
+  duk_put_global_string(ctx, DUK_HIDDEN_SYMBOL("jobs"));
+  duk_eval_string(ctx, promise_source);
+  duk_push_c_function(
+      ctx,
+      +[](duk_context *ctx) -> duk_ret_t {
+        duk_require_function(ctx, 0);
+        duk_queue_job(ctx, 0);
+        return 0;
+      },
+      1);
+  duk_push_string(ctx, DUK_HIDDEN_SYMBOL("state"));
+  duk_push_string(ctx, DUK_HIDDEN_SYMBOL("value"));
+  duk_push_string(ctx, DUK_HIDDEN_SYMBOL("reactions"));
+  duk_push_string(ctx, DUK_HIDDEN_SYMBOL("handled"));
+  duk_push_string(ctx, DUK_HIDDEN_SYMBOL("deferred"));
+  duk_call(ctx, 6);
+  duk_put_global_string(ctx, "Promise");
+
+  duk_push_bare_object(ctx);
+  duk_put_global_string(ctx, DUK_HIDDEN_SYMBOL("immediates"));
+  duk_push_bare_object(ctx);
+  duk_put_global_string(ctx, DUK_HIDDEN_SYMBOL("idle"));
+  wakeup              = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  static auto handler = holder<std::shared_ptr<epoll>>()->reg([ctx](const epoll_event &) { on_wakeup(ctx); });
+  holder<std::shared_ptr<epoll>>()->add(EPOLLIN, wakeup, handler);
+  duk_function_list_entry funcs[] = {
+    { "queueMicrotask",
+      +[](duk_context *ctx) -> duk_ret_t {
+        duk_require_function(ctx, 0);
+        duk_queue_job(ctx, 0);
+        return 0;
+      },
+      1 },
+    { "setImmediate",
+      +[](duk_context *ctx) -> duk_ret_t {
+        immediates.push_back(store_deferred(ctx, DUK_HIDDEN_SYMBOL("immediates")));
+        duk_push_uint(ctx, last_deferred);
+        return 1;
+      },
+      1 },
+    { "clearImmediate", +[](duk_context *ctx) -> duk_ret_t { return clear_deferred(ctx, DUK_HIDDEN_SYMBOL("immediates")); }, 1 },
+    { "requestIdleCallback",
+      +[](duk_context *ctx) -> duk_ret_t {
+        std::chrono::steady_clock::time_point timeout{};
+        if (duk_is_object(ctx, 1) && duk_get_prop_string(ctx, 1, "timeout"))
+          timeout = std::chrono::steady_clock::now() + std::chrono::milliseconds(duk_require_uint(ctx, -1));
+        idle_callbacks.push_back({ store_deferred(ctx, DUK_HIDDEN_SYMBOL("idle")), timeout });
+        duk_push_uint(ctx, last_deferred);
+        return 1;
+      },
+      2 },
+    { "cancelIdleCallback", +[](duk_context *ctx) -> duk_ret_t { return clear_deferred(ctx, DUK_HIDDEN_SYMBOL("idle")); }, 1 },
+    { nullptr, nullptr, 0 },
+  };
+  duk_push_global_object(ctx);
+  duk_put_function_list(ctx, -1, funcs);
+  duk_pop(ctx);
+}
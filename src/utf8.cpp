@@ -0,0 +1,143 @@
+#include "lib.h"
+
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static bool utf8_validate_scalar(unsigned char const *p, unsigned char const *end) {
+  while (p != end) {
+    auto c = *p;
+    if (c < 0x80) {
+      p++;
+      continue;
+    }
+    size_t len;
+    uint32_t cp, min;
+    if ((c & 0xE0) == 0xC0) {
+      len = 2, cp = c & 0x1F, min = 0x80;
+    } else if ((c & 0xF0) == 0xE0) {
+      len = 3, cp = c & 0x0F, min = 0x800;
+    } else if ((c & 0xF8) == 0xF0) {
+      len = 4, cp = c & 0x07, min = 0x10000;
+    } else {
+      return false;
+    }
+    if ((size_t)(end - p) < len) return false;
+    for (size_t i = 1; i < len; i++) {
+      if ((p[i] & 0xC0) != 0x80) return false;
+      cp = cp << 6 | (p[i] & 0x3F);
+    }
+    if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) return false;
+    p += len;
+  }
+  return true;
+}
+
+#if defined(__x86_64__)
+// SSE2 is part of x86-64, but without pshufb it only buys skipping pure ASCII blocks.
+static bool utf8_validate_sse2(unsigned char const *p, unsigned char const *end) {
+  while (end - p >= 16) {
+    auto mask = _mm_movemask_epi8(_mm_loadu_si128((__m128i const *)p));
+    if (!mask) {
+      p += 16;
+      continue;
+    }
+    // blocks before this one were pure ASCII, so the first high byte starts a sequence; validate up to the next ASCII block
+    auto start = p + __builtin_ctz(mask);
+    auto stop  = start;
+    while (end - stop >= 16 && _mm_movemask_epi8(_mm_loadu_si128((__m128i const *)stop))) stop += 16;
+    if (end - stop < 16) stop = end;
+    if (!utf8_validate_scalar(start, stop)) return false;
+    p = stop;
+  }
+  return utf8_validate_scalar(p, end);
+}
+
+// Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte": every error is a property of at most
+// three nibbles of two neighbouring bytes plus the 3rd/4th byte continuation rule, checked with pshufb lookups.
+__attribute__((target("avx2"))) static bool utf8_validate_avx2(unsigned char const *p, unsigned char const *end) {
+  constexpr uint8_t TOO_SHORT = 1 << 0, TOO_LONG = 1 << 1, OVERLONG_3 = 1 << 2, TOO_LARGE = 1 << 3, SURROGATE = 1 << 4, OVERLONG_2 = 1 << 5,
+                    TOO_LARGE_1000 = 1 << 6, OVERLONG_4 = 1 << 6, TWO_CONTS = 1 << 7, CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+  auto const byte_1_high_table = _mm256_setr_epi8(
+      TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+      TOO_SHORT | OVERLONG_2, TOO_SHORT, TOO_SHORT | OVERLONG_3 | SURROGATE, TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4, TOO_LONG, TOO_LONG,
+      TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, TOO_SHORT | OVERLONG_2, TOO_SHORT,
+      TOO_SHORT | OVERLONG_3 | SURROGATE, TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+  auto const byte_1_low_table = _mm256_setr_epi8(
+      CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY, CARRY | TOO_LARGE, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY, CARRY | TOO_LARGE, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000);
+  auto const byte_2_high_table = _mm256_setr_epi8(
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, TOO_SHORT, TOO_SHORT,
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, TOO_SHORT, TOO_SHORT,
+      TOO_SHORT, TOO_SHORT);
+  // a block ending in the first bytes of a multi-byte sequence has to be followed by continuations
+  auto const incomplete_max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                               -1, -1, -1, (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+  auto const nibble    = _mm256_set1_epi8(0x0F);
+  auto error           = _mm256_setzero_si256();
+  auto prev_input      = _mm256_setzero_si256();
+  auto prev_incomplete = _mm256_setzero_si256();
+  alignas(32) unsigned char tail[32] = {};
+  for (; p < end; p += 32) {
+    __m256i input;
+    if (end - p >= 32) {
+      input = _mm256_loadu_si256((__m256i const *)p);
+    } else {
+      memcpy(tail, p, end - p);
+      input = _mm256_load_si256((__m256i const *)tail);
+    }
+    if (_mm256_movemask_epi8(input)) {
+      auto shifted     = _mm256_permute2x128_si256(prev_input, input, 0x21);
+      auto prev1       = _mm256_alignr_epi8(input, shifted, 16 - 1);
+      auto prev2       = _mm256_alignr_epi8(input, shifted, 16 - 2);
+      auto prev3       = _mm256_alignr_epi8(input, shifted, 16 - 3);
+      auto byte_1_high = _mm256_shuffle_epi8(byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+      auto byte_1_low  = _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, nibble));
+      auto byte_2_high = _mm256_shuffle_epi8(byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+      auto special     = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+      auto is_third    = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+      auto is_fourth   = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+      auto must23_80   = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth), _mm256_set1_epi8((char)0x80));
+      error            = _mm256_or_si256(error, _mm256_xor_si256(must23_80, special));
+      prev_incomplete  = _mm256_subs_epu8(input, incomplete_max);
+    } else {
+      error = _mm256_or_si256(error, prev_incomplete);
+    }
+    prev_input = input;
+  }
+  error = _mm256_or_si256(error, prev_incomplete);
+  return _mm256_testz_si256(error, error);
+}
+
+static auto const utf8_validate_impl = (__builtin_cpu_init(), __builtin_cpu_supports("avx2")) ? utf8_validate_avx2 : utf8_validate_sse2;
+#else
+static auto const utf8_validate_impl = utf8_validate_scalar;
+#endif
+
+bool utf8_validate(char const *data, size_t len) {
+  auto p = (unsigned char const *)data;
+  return utf8_validate_impl(p, p + len);
+}
+
+bool utf8_validate(char const *data, size_t len, utf8_kernel kernel) {
+  auto p = (unsigned char const *)data;
+  switch (kernel) {
+#if defined(__x86_64__)
+  case utf8_kernel::sse2: return utf8_validate_sse2(p, p + len);
+  case utf8_kernel::avx2: return __builtin_cpu_supports("avx2") && utf8_validate_avx2(p, p + len);
+#endif
+  default: return utf8_validate_scalar(p, p + len);
+  }
+}
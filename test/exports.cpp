@@ -0,0 +1,46 @@
+#include <cstdio>
+#include <duktape.h>
+#include <stdexcept>
+#include <string>
+
+#include "../src/lib.h"
+
+static int failures;
+
+static void check(bool ok, char const *what) {
+  if (ok) return;
+  fprintf(stderr, "FAIL %s\n", what);
+  failures++;
+}
+
+static std::string call_error(duk_context *ctx, char const *name) {
+  try {
+    export_dispatch(ctx, export_slot(name), nullptr, nullptr, nlohmann::json::object());
+  } catch (std::exception &e) { return e.what(); }
+  return {};
+}
+
+int main() {
+  auto ctx = duk_create_heap_default();
+  init_duk_json(ctx);
+  init_duk_exports(ctx);
+  // the values stay on the stack, the way the exports proxy's target keeps them reachable
+  duk_push_int(ctx, 42);
+  export_define(ctx, "answer", -1);
+  duk_push_object(ctx);
+  export_define(ctx, "table", -1);
+  duk_eval_string(ctx, "(function(arg) { return arg.x * 2; })");
+  export_define(ctx, "twice", -1);
+  auto top = duk_get_top(ctx);
+
+  // a primitive or plain object export fails the call with a TypeError instead of throwing out of Duktape
+  check(call_error(ctx, "answer").find("TypeError") == 0, "primitive export rejects the call");
+  check(call_error(ctx, "table").find("TypeError") == 0, "object export rejects the call");
+  check(duk_get_top(ctx) == top, "rejected calls leave the value stack as it was");
+  auto ret = export_dispatch(ctx, export_slot("twice"), nullptr, nullptr, { { "x", 21 } });
+  check(ret == 42, "function export still answers");
+  check(duk_get_top(ctx) == top, "calls leave the value stack as it was");
+
+  duk_destroy_heap(ctx);
+  return failures != 0;
+}